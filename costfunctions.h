@@ -1,5 +1,81 @@
 #pragma once
 
+// Analytic counterparts of the autodiff costs below, used by the
+// batched cost functions at the end. Each cost with an evaluate() takes
+// the 6 pose parameters and writes its residuals and, if jacobian
+// isn't NULL, the row-major residuals x 6 jacobian. rotation(x) builds
+// the Rotation that evaluate() expects, so a batch of costs computes it
+// once per pose.
+
+inline void skew(const double v[3], double m[3][3]) {
+    m[0][0] = 0;     m[0][1] = -v[2]; m[0][2] = v[1];
+    m[1][0] = v[2];  m[1][1] = 0;     m[1][2] = -v[0];
+    m[2][0] = -v[1]; m[2][1] = v[0];  m[2][2] = 0;
+}
+
+struct Rotation {
+    // R(w) and B = R(w) Jr(w), Jr being the right jacobian of SO(3),
+    // so that d(R p)/dw = -R [p]x Jr = -[R p]x B. computed once per
+    // pose and shared by every point rotated by it.
+    // near zero ceres uses p + w x p, whose derivative is -[p]x
+    Rotation(const double w[3]) {
+        double theta2 = w[0]*w[0] + w[1]*w[1] + w[2]*w[2];
+        small = theta2 <= std::numeric_limits<double>::epsilon();
+        if(small) {
+            skew(w, R);
+            for(int i=0; i<3; i++) {
+                R[i][i] = 1;
+                for(int j=0; j<3; j++) {
+                    B[i][j] = i == j;
+                }
+            }
+            return;
+        }
+        double theta = std::sqrt(theta2),
+               c = std::cos(theta),
+               s = std::sin(theta),
+               k[3] = {w[0]/theta, w[1]/theta, w[2]/theta};
+        double wx[3][3], wx2[3][3], Jr[3][3];
+        skew(k, R);
+        for(int i=0; i<3; i++) {
+            for(int j=0; j<3; j++) {
+                R[i][j] = R[i][j]*s + k[i]*k[j]*(1 - c) + (i == j ? c : 0);
+            }
+        }
+        skew(w, wx);
+        for(int i=0; i<3; i++) {
+            for(int j=0; j<3; j++) {
+                wx2[i][j] = wx[i][0]*wx[0][j] + wx[i][1]*wx[1][j] + wx[i][2]*wx[2][j];
+            }
+        }
+        double a = (1 - c) / theta2, b = (theta - s) / (theta2 * theta);
+        for(int i=0; i<3; i++) {
+            for(int j=0; j<3; j++) {
+                Jr[i][j] = (i == j) - a*wx[i][j] + b*wx2[i][j];
+            }
+        }
+        for(int i=0; i<3; i++) {
+            for(int j=0; j<3; j++) {
+                B[i][j] = R[i][0]*Jr[0][j] + R[i][1]*Jr[1][j] + R[i][2]*Jr[2][j];
+            }
+        }
+    }
+    // Rp = R p and J = d(Rp)/dw
+    inline void apply(const double p[3], double Rp[3], double J[3][3]) const {
+        for(int i=0; i<3; i++) {
+            Rp[i] = R[i][0]*p[0] + R[i][1]*p[1] + R[i][2]*p[2];
+        }
+        const double *q = small ? p : Rp;
+        for(int j=0; j<3; j++) {
+            J[0][j] = q[2]*B[1][j] - q[1]*B[2][j];
+            J[1][j] = q[0]*B[2][j] - q[2]*B[0][j];
+            J[2][j] = q[1]*B[0][j] - q[0]*B[1][j];
+        }
+    }
+    double R[3][3], B[3][3];
+    bool small;
+};
+
 struct costVertical {
     costVertical() {}
     template <typename T>
@@ -52,6 +128,27 @@ struct cost3DPD {
             + M[2] * T(normal_z);
         return true;
     }
+    static Rotation rotation(const double* x) {
+        return Rotation(x);
+    }
+    bool evaluate(const double* x, double* residual, double* jacobian) const {
+        return evaluate(rotation(x), x, residual, jacobian);
+    }
+    bool evaluate(const Rotation &rot, const double* x, double* residual, double* jacobian) const {
+        double M_original[3] = {point_x, point_y, point_z}, M[3], dM[3][3];
+        rot.apply(M_original, M, dM);
+        double n[3] = {normal_x, normal_y, normal_z};
+        residual[0] = (M[0] + x[3] - offset_x) * n[0]
+            + (M[1] + x[4] - offset_y) * n[1]
+            + (M[2] + x[5] - offset_z) * n[2];
+        if(jacobian) {
+            for(int j=0; j<3; j++) {
+                jacobian[j] = n[0]*dM[0][j] + n[1]*dM[1][j] + n[2]*dM[2][j];
+                jacobian[3+j] = n[j];
+            }
+        }
+        return true;
+    }
     double point_x, point_y, point_z,
            normal_x, normal_y, normal_z,
            offset_x, offset_y, offset_z;
@@ -85,6 +182,28 @@ struct cost3D3D {
         residual[2] = M[2] + x[5] - T(s_z);
         return true;
     }
+    static Rotation rotation(const double* x) {
+        return Rotation(x);
+    }
+    bool evaluate(const double* x, double* residual, double* jacobian) const {
+        return evaluate(rotation(x), x, residual, jacobian);
+    }
+    bool evaluate(const Rotation &rot, const double* x, double* residual, double* jacobian) const {
+        double M_original[3] = {m_x, m_y, m_z}, M[3], dM[3][3];
+        rot.apply(M_original, M, dM);
+        residual[0] = M[0] + x[3] - s_x;
+        residual[1] = M[1] + x[4] - s_y;
+        residual[2] = M[2] + x[5] - s_z;
+        if(jacobian) {
+            for(int i=0; i<3; i++) {
+                for(int j=0; j<3; j++) {
+                    jacobian[i*6 + j] = dM[i][j];
+                    jacobian[i*6 + 3+j] = i == j;
+                }
+            }
+        }
+        return true;
+    }
     double m_x, m_y, m_z,
            s_x, s_y, s_z;
 };
@@ -124,6 +243,30 @@ struct cost3D2D {
         residual[1] = M[1] - T(s_y) * M[2];
         return true;
     }
+    static Rotation rotation(const double* x) {
+        return Rotation(x);
+    }
+    bool evaluate(const double* x, double* residual, double* jacobian) const {
+        return evaluate(rotation(x), x, residual, jacobian);
+    }
+    bool evaluate(const Rotation &rot, const double* x, double* residual, double* jacobian) const {
+        double M_original[3] = {m_x, m_y, m_z}, M[3], dM[3][3];
+        rot.apply(M_original, M, dM);
+        M[0] += x[3] + t_x;
+        M[1] += x[4] + t_y;
+        M[2] += x[5] + t_z;
+        residual[0] = M[0] - s_x * M[2];
+        residual[1] = M[1] - s_y * M[2];
+        if(jacobian) {
+            for(int j=0; j<3; j++) {
+                jacobian[j] = dM[0][j] - s_x * dM[2][j];
+                jacobian[6+j] = dM[1][j] - s_y * dM[2][j];
+            }
+            jacobian[3] = 1; jacobian[4] = 0; jacobian[5] = -s_x;
+            jacobian[9] = 0; jacobian[10] = 1; jacobian[11] = -s_y;
+        }
+        return true;
+    }
     double m_x, m_y, m_z,
            s_x, s_y,
            t_x, t_y, t_z;
@@ -166,6 +309,35 @@ struct cost2D3D {
 
         return true;
     }
+    static Rotation rotation(const double* x) {
+        double rot[3] = {-x[0], -x[1], -x[2]};
+        return Rotation(rot);
+    }
+    bool evaluate(const double* x, double* residual, double* jacobian) const {
+        return evaluate(rotation(x), x, residual, jacobian);
+    }
+    bool evaluate(const Rotation &rot, const double* x, double* residual, double* jacobian) const {
+        // M = R(-w) (m - t) + t_cam, rot being R(-w)
+        double M_original[3] = {m_x - x[3], m_y - x[4], m_z - x[5]},
+               M[3], dM[3][3];
+        const double (&R)[3][3] = rot.R;
+        rot.apply(M_original, M, dM);
+        M[0] += t_x;
+        M[1] += t_y;
+        M[2] += t_z;
+        residual[0] = M[0] - s_x * M[2];
+        residual[1] = M[1] - s_y * M[2];
+        if(jacobian) {
+            for(int j=0; j<3; j++) {
+                // d/dw = -d/drot, d/dt = -R(-w)
+                jacobian[j] = -(dM[0][j] - s_x * dM[2][j]);
+                jacobian[6+j] = -(dM[1][j] - s_y * dM[2][j]);
+                jacobian[3+j] = -(R[0][j] - s_x * R[2][j]);
+                jacobian[9+j] = -(R[1][j] - s_y * R[2][j]);
+            }
+        }
+        return true;
+    }
     double m_x, m_y, m_z,
            s_x, s_y,
            t_x, t_y, t_z;
@@ -214,6 +386,48 @@ struct cost2D2D {
                 M[2] * (-s_x * tt_y + s_y * tt_x);
         return true;
     }
+    static Rotation rotation(const double* x) {
+        return Rotation(x);
+    }
+    bool evaluate(const double* x, double* residual, double* jacobian) const {
+        return evaluate(rotation(x), x, residual, jacobian);
+    }
+    bool evaluate(const Rotation &rot, const double* x, double* residual, double* jacobian) const {
+        double M_original[3] = {m_x, m_y, 1.0}, M[3], dM[3][3];
+        rot.apply(M_original, M, dM);
+        double Rtt[3] = {t_x, t_y, t_z}, tt[3], dtt[3][3];
+        rot.apply(Rtt, tt, dtt);
+        double T[3] = {
+            -tt[0] + x[3] + t_x,
+            -tt[1] + x[4] + t_y,
+            -tt[2] + x[5] + t_z};
+        double tn = std::sqrt(T[0]*T[0] + T[1]*T[1] + T[2]*T[2]);
+        double n[3] = {T[0]/tn, T[1]/tn, T[2]/tn};
+        // residual = M . (n x s), s = (s_x, s_y, 1)
+        double a[3] = {
+            -s_y * n[2] + n[1],
+             s_x * n[2] - n[0],
+            -s_x * n[1] + s_y * n[0]};
+        residual[0] = M[0] * a[0] + M[1] * a[1] + M[2] * a[2];
+        if(jacobian) {
+            // d residual/dn = s x M, dn/dT = (I - n n^T)/|T|
+            double sxM[3] = {
+                s_y * M[2] - M[1],
+                M[0] - s_x * M[2],
+                s_x * M[1] - s_y * M[0]};
+            double sn = sxM[0]*n[0] + sxM[1]*n[1] + sxM[2]*n[2], g[3];
+            for(int i=0; i<3; i++) {
+                g[i] = (sxM[i] - sn * n[i]) / tn;
+            }
+            for(int j=0; j<3; j++) {
+                // dT/dw = -dtt/dw, dT/dt = I
+                jacobian[j] = a[0]*dM[0][j] + a[1]*dM[1][j] + a[2]*dM[2][j]
+                    - (g[0]*dtt[0][j] + g[1]*dtt[1][j] + g[2]*dtt[2][j]);
+                jacobian[3+j] = g[j];
+            }
+        }
+        return true;
+    }
     double m_x, m_y,
            s_x, s_y,
            t_x, t_y, t_z;
@@ -373,3 +587,200 @@ struct triangulation3D {
     double s_x, s_y, s_z,
            cam_0, cam_1, cam_2, cam_3, cam_4, cam_5;
 };
+
+struct RobustLoss {
+    // rho(s) of ceres::ArctanLoss or ceres::CauchyLoss scaled by weight
+    // like ceres::ScaledLoss, for use inside batched cost functions
+    enum Type {
+        ARCTAN,
+        CAUCHY
+    };
+    RobustLoss(Type type, double a, double weight = 1) :
+        type(type),
+        a(a),
+        weight(weight) {}
+    inline void evaluate(double s, double &rho, double &drho) const {
+        if(type == ARCTAN) {
+            rho = a * std::atan2(s, a);
+            drho = 1 / (1 + s*s / (a*a));
+        } else {
+            rho = a*a * std::log1p(s / (a*a));
+            drho = 1 / (1 + s / (a*a));
+        }
+    }
+    // Scales a residual r of size n by c so that |c r|^2 = weight * rho(|r|^2),
+    // and its jacobian by the exact derivative of c r
+    inline void apply(double *residual, double *jacobian, int n) const {
+        double s = 0;
+        for(int i=0; i<n; i++) {
+            s += residual[i] * residual[i];
+        }
+        double c = std::sqrt(weight), dc = 0;
+        if(s > 0) {
+            double rho, drho;
+            evaluate(s, rho, drho);
+            c = std::sqrt(weight * rho / s);
+            dc = weight * (drho * s - rho) / (s * s) / (2 * c);
+        }
+        if(jacobian) {
+            for(int j=0; j<6; j++) {
+                double rj = 0;
+                for(int i=0; i<n; i++) {
+                    rj += residual[i] * jacobian[i*6 + j];
+                }
+                for(int i=0; i<n; i++) {
+                    jacobian[i*6 + j] = c * jacobian[i*6 + j] + 2 * dc * residual[i] * rj;
+                }
+            }
+        }
+        for(int i=0; i<n; i++) {
+            residual[i] *= c;
+        }
+    }
+    Type type;
+    double a, weight;
+};
+
+struct NormalEquations {
+    // J^T W J, J^T W r and the robust cost of residuals in the
+    // 6 pose parameters, W holding the IRLS weights weight*rho'(s)
+    NormalEquations() {
+        setZero();
+    }
+    void setZero() {
+        H.setZero();
+        g.setZero();
+        cost = 0;
+    }
+    NormalEquations& operator+=(const NormalEquations &other) {
+        H += other.H;
+        g += other.g;
+        cost += other.cost;
+        return *this;
+    }
+    Eigen::Matrix<double, 6, 6> H;
+    Eigen::Matrix<double, 6, 1> g;
+    double cost;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+class PoseBatch {
+    // residuals of the pose that solvePose can accumulate a range of
+    public:
+    virtual ~PoseBatch() {}
+    virtual int size() const = 0;
+    // adds residuals [begin, end) at x to ne, only the cost if !jacobians
+    virtual void accumulate(
+            const double *x,
+            const int begin,
+            const int end,
+            NormalEquations &ne,
+            const bool jacobians) const = 0;
+};
+
+// All correspondences of one residual type as a single ceres cost
+// function of the 6 pose parameters, costs stored contiguously and
+// the robust loss applied per correspondence inside Evaluate. It's
+// reused between solves, so add it with DO_NOT_TAKE_OWNERSHIP.
+// Outliers are masked in place by gate(), a masked correspondence
+// keeps its zeroed residuals so the problem's shape doesn't change
+template <typename Cost, int kResidualSize>
+class BatchedCostFunction : public ceres::CostFunction, public PoseBatch {
+    public:
+    BatchedCostFunction(const RobustLoss &loss) : loss(loss) {
+        mutable_parameter_block_sizes()->push_back(6);
+        set_num_residuals(0);
+    }
+    void clear() {
+        costs.clear();
+        active.clear();
+        set_num_residuals(0);
+    }
+    void push_back(const Cost &cost) {
+        costs.push_back(cost);
+        active.push_back(1);
+        set_num_residuals(costs.size() * kResidualSize);
+    }
+    // masks correspondences whose residual norm at x is over thresh
+    // and unmasks the others, returns how many are left
+    int gate(const double *x, const double thresh) {
+        Rotation rot = Cost::rotation(x);
+        int n = 0;
+        for(int i=0; i<costs.size(); i++) {
+            double r[kResidualSize], s = 0;
+            costs[i].evaluate(rot, x, r, NULL);
+            for(int j=0; j<kResidualSize; j++) {
+                s += r[j] * r[j];
+            }
+            active[i] = s <= thresh * thresh;
+            n += active[i];
+        }
+        return n;
+    }
+    int size() const {
+        return costs.size();
+    }
+    bool Evaluate(
+            double const* const* parameters,
+            double* residuals,
+            double** jacobians) const {
+        const double *x = parameters[0];
+        double *jacobian = jacobians ? jacobians[0] : NULL;
+        Rotation rot = Cost::rotation(x);
+        for(int i=0; i<costs.size(); i++) {
+            double *r = residuals + i*kResidualSize,
+                   *J = jacobian ? jacobian + i*kResidualSize*6 : NULL;
+            if(!active[i]) {
+                std::fill(r, r + kResidualSize, 0.0);
+                if(J) std::fill(J, J + kResidualSize*6, 0.0);
+                continue;
+            }
+            costs[i].evaluate(rot, x, r, J);
+            loss.apply(r, J, kResidualSize);
+        }
+        return true;
+    }
+    void accumulate(
+            const double *x,
+            const int begin,
+            const int end,
+            NormalEquations &ne,
+            const bool jacobians) const {
+        typedef Eigen::Matrix<double, kResidualSize, 6, Eigen::RowMajor> Jacobian;
+        Rotation rot = Cost::rotation(x);
+        double r[kResidualSize], J[kResidualSize * 6];
+        for(int i=begin; i<end; i++) {
+            if(!active[i]) continue;
+            costs[i].evaluate(rot, x, r, jacobians ? J : NULL);
+            double s = 0, rho, drho;
+            for(int j=0; j<kResidualSize; j++) {
+                s += r[j] * r[j];
+            }
+            loss.evaluate(s, rho, drho);
+            ne.cost += loss.weight * rho / 2;
+            if(jacobians) {
+                Eigen::Map<const Jacobian> Jm(J);
+                Eigen::Map<const Eigen::Matrix<double, kResidualSize, 1>> rm(r);
+                double w = loss.weight * drho;
+                ne.H.noalias() += w * Jm.transpose() * Jm;
+                ne.g.noalias() += w * Jm.transpose() * rm;
+            }
+        }
+    }
+    // squared norms of the unmasked residuals before the loss, for statistics
+    void squaredNorms(const double *x, std::vector<double> &norms) const {
+        Rotation rot = Cost::rotation(x);
+        for(int i=0; i<costs.size(); i++) {
+            if(!active[i]) continue;
+            double r[kResidualSize], s = 0;
+            costs[i].evaluate(rot, x, r, NULL);
+            for(int j=0; j<kResidualSize; j++) {
+                s += r[j] * r[j];
+            }
+            norms.push_back(s);
+        }
+    }
+    std::vector<Cost> costs;
+    std::vector<unsigned char> active;
+    RobustLoss loss;
+};
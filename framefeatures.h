@@ -0,0 +1,366 @@
+#pragma once
+
+const int descriptor_bytes = 64; // FREAK descriptors are 512 bits
+
+inline int hammingDistance(
+        const unsigned char *a,
+        const unsigned char *b
+        ) {
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+    // a whole descriptor is one register
+    __m512i x = _mm512_xor_si512(
+            _mm512_loadu_si512(a),
+            _mm512_loadu_si512(b));
+    return _mm512_reduce_add_epi64(_mm512_popcnt_epi64(x));
+#elif defined(__AVX2__)
+    // popcount of each nibble by table lookup, summed with sad
+    const __m256i lut = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4),
+          low = _mm256_set1_epi8(0x0f);
+    __m256i x0 = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)a),
+            _mm256_loadu_si256((const __m256i*)b)),
+        x1 = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)(a + 32)),
+            _mm256_loadu_si256((const __m256i*)(b + 32)));
+    __m256i c0 = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(x0, low)),
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(
+                    _mm256_srli_epi16(x0, 4), low))),
+        c1 = _mm256_add_epi8(
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(x1, low)),
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(
+                    _mm256_srli_epi16(x1, 4), low)));
+    // at most 16 per byte, so adding the halves can't overflow
+    __m256i sum = _mm256_sad_epu8(
+            _mm256_add_epi8(c0, c1), _mm256_setzero_si256());
+    __m128i s = _mm_add_epi64(
+            _mm256_castsi256_si128(sum),
+            _mm256_extracti128_si256(sum, 1));
+    return _mm_cvtsi128_si32(s) + _mm_extract_epi32(s, 2);
+#else
+    int d = 0;
+    for(int i=0; i<descriptor_bytes; i+=8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        d += __builtin_popcountll(x ^ y);
+    }
+    return d;
+#endif
+}
+
+// Features of one camera at one frame, as parallel arrays.
+// Descriptors are stored back to back, descriptor_bytes each,
+// and removing features compacts everything in place,
+// so once the capacity is there nothing gets reallocated.
+struct FrameFeatures {
+    // camera canonical coordinates
+    std::vector<cv::Point2f> keypoints;
+    // pixel coordinates
+    std::vector<cv::Point2f> keypoints_p;
+    std::vector<int> ids;
+    std::vector<unsigned char> desc;
+    // -1 if no depth, index of kp_with_depth otherwise
+    std::vector<int> has_depth;
+    // interpolated lidar point, physical coordinates
+    pcl::PointCloud<pcl::PointXYZ>::Ptr kp_with_depth;
+
+    FrameFeatures() :
+        kp_with_depth(new pcl::PointCloud<pcl::PointXYZ>) {}
+    // copies get their own cloud rather than sharing the pointer
+    FrameFeatures(const FrameFeatures &other) :
+        keypoints(other.keypoints),
+        keypoints_p(other.keypoints_p),
+        ids(other.ids),
+        desc(other.desc),
+        has_depth(other.has_depth),
+        kp_with_depth(new pcl::PointCloud<pcl::PointXYZ>(*other.kp_with_depth)) {}
+    FrameFeatures &operator=(const FrameFeatures &other) {
+        keypoints = other.keypoints;
+        keypoints_p = other.keypoints_p;
+        ids = other.ids;
+        desc = other.desc;
+        has_depth = other.has_depth;
+        *kp_with_depth = *other.kp_with_depth;
+        return *this;
+    }
+
+    int size() const {return ids.size();}
+    void reserve(const int n) {
+        keypoints.reserve(n);
+        keypoints_p.reserve(n);
+        ids.reserve(n);
+        desc.reserve(n * descriptor_bytes);
+        has_depth.reserve(n);
+        kp_with_depth->reserve(n);
+    }
+    void clear() {
+        keypoints.clear();
+        keypoints_p.clear();
+        ids.clear();
+        desc.clear();
+        has_depth.clear();
+        kp_with_depth->clear();
+    }
+    void push_back(
+            const cv::Point2f &kp,
+            const cv::Point2f &kp_p,
+            const int id,
+            const unsigned char *d
+            ) {
+        // depth has to be associated again for the new set of features
+        has_depth.clear();
+        kp_with_depth->clear();
+        keypoints.push_back(kp);
+        keypoints_p.push_back(kp_p);
+        ids.push_back(id);
+        desc.insert(desc.end(), d, d + descriptor_bytes);
+    }
+    const unsigned char *descriptor(const int i) const {
+        return desc.data() + i * descriptor_bytes;
+    }
+    cv::Mat descriptors() const {
+        // header over desc for OpenCV, no copy;
+        // only valid until the features change
+        if(ids.empty()) return cv::Mat();
+        return cv::Mat(size(), descriptor_bytes, CV_8U,
+                const_cast<unsigned char*>(desc.data()));
+    }
+    void compact(const std::vector<char> &keep) {
+        // keeps feature i iff keep[i], preserving order.
+        // depth is kept along if it has been associated already
+        bool depth = has_depth.size() == ids.size();
+        int n = size(), j = 0, jd = 0;
+        for(int i=0; i<n; i++) {
+            if(!keep[i]) continue;
+            keypoints[j] = keypoints[i];
+            keypoints_p[j] = keypoints_p[i];
+            ids[j] = ids[i];
+            if(j != i) {
+                memcpy(desc.data() + j * descriptor_bytes,
+                        desc.data() + i * descriptor_bytes,
+                        descriptor_bytes);
+            }
+            if(depth) {
+                // depth indices increase with i, so this is in place too
+                int d = has_depth[i];
+                if(d != -1) {
+                    kp_with_depth->points[jd] = kp_with_depth->points[d];
+                    has_depth[j] = jd++;
+                } else {
+                    has_depth[j] = -1;
+                }
+            }
+            j++;
+        }
+        keypoints.resize(j);
+        keypoints_p.resize(j);
+        ids.resize(j);
+        desc.resize(j * descriptor_bytes);
+        if(depth) {
+            has_depth.resize(j);
+            kp_with_depth->resize(jd);
+        }
+    }
+    size_t bytes() const {
+        return sizeof(FrameFeatures)
+            + (keypoints.capacity() + keypoints_p.capacity())
+                * sizeof(cv::Point2f)
+            + (ids.capacity() + has_depth.capacity()) * sizeof(int)
+            + desc.capacity()
+            + kp_with_depth->points.capacity() * sizeof(pcl::PointXYZ);
+    }
+    void write(std::ostream &out) const {
+        bool depth = has_depth.size() == size();
+        int n = size(), nd = depth ? kp_with_depth->size() : 0;
+        out.write((const char*)&n, sizeof(int));
+        out.write((const char*)&nd, sizeof(int));
+        out.write((const char*)keypoints.data(), n * sizeof(cv::Point2f));
+        out.write((const char*)keypoints_p.data(), n * sizeof(cv::Point2f));
+        out.write((const char*)ids.data(), n * sizeof(int));
+        out.write((const char*)desc.data(), n * descriptor_bytes);
+        if(depth) {
+            out.write((const char*)has_depth.data(), n * sizeof(int));
+            for(int i=0; i<nd; i++) {
+                const pcl::PointXYZ &p = kp_with_depth->points[i];
+                float xyz[3] = {p.x, p.y, p.z};
+                out.write((const char*)xyz, sizeof(xyz));
+            }
+        } else {
+            // depth never associated
+            std::vector<int> no_depth(n, -1);
+            out.write((const char*)no_depth.data(), n * sizeof(int));
+        }
+    }
+    void read(std::istream &in) {
+        int n = 0, nd = 0;
+        in.read((char*)&n, sizeof(int));
+        in.read((char*)&nd, sizeof(int));
+        keypoints.resize(n);
+        keypoints_p.resize(n);
+        ids.resize(n);
+        desc.resize(n * descriptor_bytes);
+        has_depth.resize(n);
+        in.read((char*)keypoints.data(), n * sizeof(cv::Point2f));
+        in.read((char*)keypoints_p.data(), n * sizeof(cv::Point2f));
+        in.read((char*)ids.data(), n * sizeof(int));
+        in.read((char*)desc.data(), n * descriptor_bytes);
+        in.read((char*)has_depth.data(), n * sizeof(int));
+        kp_with_depth->resize(nd);
+        for(int i=0; i<nd; i++) {
+            float xyz[3];
+            in.read((char*)xyz, sizeof(xyz));
+            kp_with_depth->points[i] = pcl::PointXYZ(xyz[0], xyz[1], xyz[2]);
+        }
+    }
+    void swapFeatures(FrameFeatures &other) {
+        // exchanges everything but the depth association,
+        // which no longer applies to the new features
+        has_depth.clear();
+        kp_with_depth->clear();
+        keypoints.swap(other.keypoints);
+        keypoints_p.swap(other.keypoints_p);
+        ids.swap(other.ids);
+        desc.swap(other.desc);
+    }
+};
+
+// Features of the most recent frames, all cameras.
+// Frames that fall out of the window hand their buffers over
+// to the new frames, so memory stays at window frames' worth
+// however long the sequence is. If a spill path is given,
+// old frames are written there first and read back on demand,
+// which loop closure needs; otherwise they are dropped.
+// References stay valid until the next advance().
+class FrameStore {
+    private:
+    const int window;
+    const std::string spill_path;
+    // [slot][cam], slot = frame % window
+    std::vector<std::vector<FrameFeatures>> slots;
+    std::vector<int> slot_frame;
+    // old frames read back from disk since the last advance()
+    mutable std::map<int, std::vector<FrameFeatures>> recalled;
+    mutable std::mutex recall_mutex;
+    int spilled = 0;
+
+    static const FrameFeatures &empty() {
+        // handed out for missing frames, never written, so it can be
+        // shared by any number of threads
+        static const FrameFeatures none;
+        return none;
+    }
+    std::string spillFile(const int frame) const {
+        return spill_path + std::to_string(frame) + ".bin";
+    }
+    void spill(const int frame, const std::vector<FrameFeatures> &f) {
+        std::ofstream out(spillFile(frame), std::ios::binary);
+        for(int cam=0; cam<num_cams; cam++) {
+            f[cam].write(out);
+        }
+        if(!out) {
+            std::cerr << "ERROR: could not spill frame " << frame
+                << " to " << spillFile(frame) << std::endl;
+            return;
+        }
+        spilled++;
+    }
+    const FrameFeatures &recall(const int cam, const int frame) const {
+        std::lock_guard<std::mutex> lock(recall_mutex);
+        auto found = recalled.find(frame);
+        if(found != recalled.end()) {
+            return found->second[cam];
+        }
+        std::ifstream in(spillFile(frame), std::ios::binary);
+        if(!in) {
+            std::cerr << "ERROR: features of frame " << frame
+                << " are no longer available" << std::endl;
+            return empty();
+        }
+        std::vector<FrameFeatures> &f = recalled[frame];
+        f.resize(num_cams);
+        for(int c=0; c<num_cams; c++) {
+            f[c].read(in);
+        }
+        return f[cam];
+    }
+
+    public:
+    FrameStore(
+            const int window,
+            const std::string spill_path = ""
+            ) :
+        window(window),
+        spill_path(spill_path),
+        slots(window, std::vector<FrameFeatures>(num_cams)),
+        slot_frame(window, -1) {
+        // create the spill directory and its parents
+        for(int i=1; i<=spill_path.size(); i++) {
+            if(i == spill_path.size() || spill_path[i] == '/') {
+                mkdir(spill_path.substr(0, i).c_str(), 0755);
+            }
+        }
+    }
+    void advance(const int frame) {
+        // makes room for frame, retiring the frame in its slot
+        int s = frame % window;
+        if(slot_frame[s] != -1 && !spill_path.empty()) {
+            spill(slot_frame[s], slots[s]);
+        }
+        for(int cam=0; cam<num_cams; cam++) {
+            slots[s][cam].clear();
+            // room for everything tracked in from every camera
+            slots[s][cam].reserve(num_cams * corner_count);
+        }
+        slot_frame[s] = frame;
+        std::lock_guard<std::mutex> lock(recall_mutex);
+        recalled.clear();
+    }
+    const FrameFeatures &at(const int cam, const int frame) const {
+        int s = frame % window;
+        if(slot_frame[s] == frame) {
+            return slots[s][cam];
+        }
+        if(spill_path.empty()) {
+            std::cerr << "ERROR: frame " << frame
+                << " is outside the feature window" << std::endl;
+            return empty();
+        }
+        return recall(cam, frame);
+    }
+    FrameFeatures &at(const int cam, const int frame) {
+        // only frames in the window are written to, anything else
+        // is shared with other threads or gone, so it's a bug
+        int s = frame % window;
+        if(slot_frame[s] != frame) {
+            std::cerr << "ERROR: writing to frame " << frame
+                << " outside the feature window" << std::endl;
+            std::abort();
+        }
+        return slots[s][cam];
+    }
+    size_t bytes() const {
+        size_t b = 0;
+        for(auto &slot : slots) {
+            for(auto &f : slot) {
+                b += f.bytes();
+            }
+        }
+        std::lock_guard<std::mutex> lock(recall_mutex);
+        for(auto &r : recalled) {
+            for(auto &f : r.second) {
+                b += f.bytes();
+            }
+        }
+        return b;
+    }
+    void printStats(std::ostream &out) const {
+        out << "Feature store:"
+            << " window " << window
+            << " spilled " << spilled
+            << " MB " << (bytes() >> 20)
+            << std::endl;
+    }
+};
@@ -11,7 +11,24 @@ const int num_cams = 2, // number of cameras we use
     min_matches = 0, // minimum number of feature matches to proceed
     detect_every = 1, // detect new features every this number of frames
     ba_every = 10, // bundle adjust every this number of frames
-    ndiagonal = 4;
+    ndiagonal = 4,
+    prefetch_depth = 3, // number of frames loaded ahead in the background
+    scan_cache_budget_mb = 1024, // memory budget for cached lidar scans
+    scan_cache_shards = 16,
+    projection_grid_cols = 1024, // column buckets for depth association
+    depth_assoc_grain = 256, // keypoints per parallel chunk
+    feature_window = 4, // frames of features kept in memory
+    track_chunk = 8, // observations per allocation in the track store
+    match_grain = 64, // query descriptors per parallel chunk
+    match_tile = 256, // train descriptors matched at a time, 16 KB
+    guided_min_matches = 50, // fall back to brute force below this
+    pose_grain = 256, // residuals per parallel chunk in the pose solver
+    triangulation_grain = 64, // landmarks per parallel chunk
+    ransac_iterations = 200, // most minimal samples drawn per pose
+    ransac_min_inliers = 12, // fewer and the prediction is kept as is
+    ransac_block = 256, // correspondences scored between early exits
+    scan_tree_leaf = 16, // most lidar points in a kd-tree leaf
+    scan_tree_grain = 512; // icp queries per parallel chunk
 
 const double
     flow_outlier = 20000, // pixels^2, squared distance of optical flow
@@ -32,7 +49,13 @@ const double
     icp_norm_condition = 1e-5,
     agreement_t_thresh = 0.1, // meters
     agreement_r_thresh = 0.05, // radians
-    loop_close_thresh = 10; // meters
+    loop_close_thresh = 10, // meters
+    guided_match_radius = 40, // pixels, around the predicted position
+    pose_parameter_tolerance = 1e-8, // relative step size
+    pose_initial_lambda = 1e-4, // damping of the first pose solve
+    landmark_relinearize_thresh = 0.1, // meters, before full triangulation
+    ransac_thresh = 2.5, // inlier threshold, in loss thresholds
+    ransac_confidence = 0.99; // of drawing an all inlier sample
 
 int img_width = 1226, // kitti data
     img_height = 370;
@@ -55,6 +78,8 @@ std::ofstream output;
 std::vector<double> times;
 
 const std::string kittipath = "/home/dllu/kitti/dataset/sequences/";
+// where features of old frames go when loop closure may need them
+const std::string feature_spill_path = "spill/";
 
 void loadCalibration(
         const std::string & dataset
@@ -118,81 +143,176 @@ void loadTimes(
     }
 }
 
-void loadPoints(
-        pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud,
-        std::string dataset,
-        int n
+std::string velodynePath(
+        const std::string & dataset,
+        const int n
         ) {
     std::stringstream ss;
     ss << kittipath << dataset << "/velodyne/"
         << std::setfill('0') << std::setw(6) << n << ".bin";
-    // allocate 40 MB buffer (only ~1300*4*4 KB are needed)
-    int32_t num = 10000000;
-    float *data = (float*)malloc(num*sizeof(float));
+    return ss.str();
+}
 
-    // pointers
-    float *px = data+0;
-    float *py = data+1;
-    float *pz = data+2;
-    float *pr = data+3;
+// Read-only view of a velodyne .bin file, memory mapped straight from disk.
+// Each point is stored as 4 consecutive floats: x, y, z, reflectance,
+// so the accessors just stride over the mapping without copying anything.
+class VelodyneScan {
+    public:
+    static const int stride = 4;
+    VelodyneScan(
+            const std::string & dataset,
+            const int n
+            ) : _data(nullptr), _bytes(0), _num(0) {
+        std::string path = velodynePath(dataset, n);
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            std::cerr << "ERROR: Could not open " << path << std::endl;
+            return;
+        }
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(m != MAP_FAILED) {
+                // the whole file is read front to back exactly once
+                madvise(m, st.st_size, MADV_SEQUENTIAL);
+                madvise(m, st.st_size, MADV_WILLNEED);
+                _data = static_cast<const float*>(m);
+                _bytes = st.st_size;
+                _num = _bytes / (stride * sizeof(float));
+            } else {
+                std::cerr << "ERROR: Could not map " << path << std::endl;
+            }
+        }
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+    ~VelodyneScan() {
+        if(_data != nullptr) {
+            munmap(const_cast<float*>(_data), _bytes);
+        }
+    }
+    VelodyneScan(const VelodyneScan &) = delete;
+    VelodyneScan &operator=(const VelodyneScan &) = delete;
 
-    // load point cloud
-    FILE *stream;
-    stream = fopen (ss.str().c_str(),"rb");
-    num = fread(data,sizeof(float),num,stream)/4;
+    int size() const {return _num;}
+    const float *data() const {return _data;}
+    float x(const int i) const {return _data[i*stride + 0];}
+    float y(const int i) const {return _data[i*stride + 1];}
+    float z(const int i) const {return _data[i*stride + 2];}
+    float intensity(const int i) const {return _data[i*stride + 3];}
+    private:
+    const float *_data;
+    size_t _bytes;
+    int _num;
+};
 
+void loadPoints(
+        const VelodyneScan &scan,
+        pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud
+        ) {
+    int num = scan.size();
+    point_cloud->resize(num);
+    for(int32_t i=0; i<num; i++) {
+        point_cloud->points[i] = pcl::PointXYZ(scan.x(i), scan.y(i), scan.z(i));
+    }
+}
+
+void loadPoints(
+        pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud,
+        std::string dataset,
+        int n
+        ) {
+    VelodyneScan scan(dataset, n);
+    loadPoints(scan, point_cloud);
+}
 
-    for (int32_t i=0; i<num; i++) {
-        point_cloud->points.push_back(pcl::PointXYZ(*px,*py,*pz));
-        px+=4; py+=4; pz+=4; pr+=4;
+// Lidar scan in camera coordinates, split into rings.
+// All rings share one structure of arrays; the points of ring s
+// are at indices begin(s) .. end(s)-1 of x, y and z.
+struct RingScan {
+    std::vector<float> x, y, z;
+    std::vector<int> offsets = std::vector<int>(1, 0);
+    int size() const {return x.size();}
+    int rings() const {return offsets.size() - 1;}
+    int begin(const int s) const {return offsets[s];}
+    int end(const int s) const {return offsets[s+1];}
+    int ringSize(const int s) const {return offsets[s+1] - offsets[s];}
+    pcl::PointXYZ point(const int i) const {
+        return pcl::PointXYZ(x[i], y[i], z[i]);
     }
+    void clear() {
+        x.clear();
+        y.clear();
+        z.clear();
+        offsets.assign(1, 0);
+    }
+};
 
-    fclose(stream);
-    free(data);
+void reorderRing(
+        RingScan &scan,
+        const int start,
+        const int end
+        ) {
+    // for some reason, kitti scans are sorted in a strange way:
+    // ring[i] = raw[n - 1 - (i + n/2) % n],
+    // which is the raw ring reversed and then rotated by n/2
+    int n = end - start;
+    for(std::vector<float> *c : {&scan.x, &scan.y, &scan.z}) {
+        std::reverse(c->begin() + start, c->begin() + end);
+        std::rotate(c->begin() + start, c->begin() + start + n/2,
+                c->begin() + end);
+    }
 }
 
 void segmentPoints(
-        pcl::PointCloud<pcl::PointXYZ>::Ptr point_cloud,
-        std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans
+        const VelodyneScan &scan,
+        RingScan &rings
         ) {
+    // single pass over the mapped file: transform each point into
+    // the camera frame, find ring boundaries from the raw coordinates,
+    // and fix up the ordering of each ring in place once it is complete
+    int n = scan.size();
+    rings.clear();
+    rings.x.resize(n);
+    rings.y.resize(n);
+    rings.z.resize(n);
+    const Eigen::Matrix4f &T = velo_to_cam;
     float prev_y = 0;
-    int scan_id = 0;
-    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud_tmp(
-            new pcl::PointCloud<pcl::PointXYZ>);
-    pcl::transformPointCloud(*point_cloud, *cloud_tmp, velo_to_cam);
-    std::vector<std::vector<int>> scan_ids;
-    for(int i=0, _i = point_cloud->size(); i<_i; i++) {
-        pcl::PointXYZ p = point_cloud->at(i);
-        if(i > 0 && p.x > 0 && (p.y > 0) != (prev_y > 0)) {
-            scan_id++;
-        }
-        if(scan_id >= scans.size()) {
-            scan_ids.push_back(std::vector<int>());
-            scans.push_back(pcl::PointCloud<pcl::PointXYZ>::Ptr(
-                        new pcl::PointCloud<pcl::PointXYZ>));
+    for(int i=0; i<n; i++) {
+        float x = scan.x(i), y = scan.y(i), z = scan.z(i);
+        if(i > 0 && x > 0 && (y > 0) != (prev_y > 0)) {
+            reorderRing(rings, rings.offsets.back(), i);
+            rings.offsets.push_back(i);
         }
-        scan_ids[scan_id].push_back(i);
-        prev_y = p.y;
+        rings.x[i] = T(0,0)*x + T(0,1)*y + T(0,2)*z + T(0,3);
+        rings.y[i] = T(1,0)*x + T(1,1)*y + T(1,2)*z + T(1,3);
+        rings.z[i] = T(2,0)*x + T(2,1)*y + T(2,2)*z + T(2,3);
+        prev_y = y;
     }
-    // for some reason, kitti scans are sorted in a strange way
-    for(int s=0; s<scan_ids.size(); s++) {
-        for(int i = 0, _i = scan_ids[s].size(); i<_i; i++) {
-            pcl::PointXYZ q = cloud_tmp->at(scan_ids[s][_i - 1 - (i + _i/2) % _i]);
-            scans[s]->push_back(q);
-        }
+    if(n > 0) {
+        reorderRing(rings, rings.offsets.back(), n);
+        rings.offsets.push_back(n);
     }
-    cloud_tmp.reset();
 }
 
-cv::Mat loadImage(
+cv::Mat readImage(
         const std::string & dataset,
         const int cam,
         const int n
         ) {
+    // safe to call from loader threads, doesn't touch any globals
     std::stringstream ss;
     ss << kittipath << dataset << "/image_" << cam << "/"
         << std::setfill('0') << std::setw(6) << n << ".png";
-    cv::Mat I = cv::imread(ss.str(), 0);
+    return cv::imread(ss.str(), 0);
+}
+
+cv::Mat loadImage(
+        const std::string & dataset,
+        const int cam,
+        const int n
+        ) {
+    cv::Mat I = readImage(dataset, cam, n);
     img_width = I.cols;
     img_height = I.rows;
     return I;
@@ -5,57 +5,235 @@
 // Each scan has 130,000 points, each taking up 16 bytes
 // not counting the duplication and overhead in the kd tree
 struct ScanData {
-    std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> scans;
-    std::vector<pcl::KdTreeFLANN<pcl::PointXYZ>> trees;
+    RingScan scans;
+    // every point of scans, for icp correspondences
+    ScanTree tree;
+    // lidar projected into each camera, computed on first use
+    // and shared by every depth association of this frame
+    RingProjection projections[num_cams];
+    std::once_flag projected[num_cams];
     int _frame;
+    size_t _point_bytes = 0, _tree_bytes = 0;
     ScanData() {}
     ScanData(const std::string dataset, const int frame) {
-        pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(
-                new pcl::PointCloud<pcl::PointXYZ>);
-        loadPoints(cloud, dataset, frame);
-        segmentPoints(cloud, scans);
-        trees.resize(scans.size());
-        for(int i=0; i<scans.size(); i++) {
-            trees[i].setInputCloud(scans[i]);
-        }
+        VelodyneScan velo(dataset, frame);
+        segmentPoints(velo, scans);
+        tree.build(scans);
         _frame = frame;
+        _point_bytes = pointBytes();
+        _tree_bytes = treeBytes();
         /*
-        std::cerr << "created scandata: " << dataset 
-            << ", " << frame 
-            << ": " << scans.size()
+        std::cerr << "created scandata: " << dataset
+            << ", " << frame
+            << ": " << scans.rings()
             << std::endl;
             */
     }
+    const RingProjection &projection(const int cam) {
+        std::call_once(projected[cam], [this, cam] {
+                projectLidarToCamera(scans, projections[cam], cam);
+                });
+        return projections[cam];
+    }
+    size_t pointBytes() const {
+        // projections are sized for every point before being trimmed,
+        // so count them up front even if they haven't been made yet
+        return sizeof(ScanData)
+            + num_cams * scans.size() * (3 * sizeof(float) + sizeof(int))
+            + (scans.x.capacity() + scans.y.capacity() + scans.z.capacity())
+                * sizeof(float)
+            + scans.offsets.capacity() * sizeof(int);
+    }
+    size_t treeBytes() const {
+        return tree.bytes();
+    }
+    size_t bytes() const {
+        return _point_bytes + _tree_bytes;
+    }
+};
+
+// A scan stays alive for as long as someone holds its handle,
+// and the cache will not evict a scan whose handle is held outside of it.
+typedef std::shared_ptr<ScanData> ScanHandle;
+
+class ScanEvictionPolicy {
+    public:
+    virtual ~ScanEvictionPolicy() {}
+    // candidates are the evictable frames, least recently used first,
+    // frame is the one most recently requested.
+    // returns an index into candidates
+    virtual int victim(
+            const std::vector<int> &candidates,
+            const int frame) const = 0;
+};
+
+class LRUEviction : public ScanEvictionPolicy {
+    public:
+    int victim(
+            const std::vector<int> &candidates,
+            const int frame) const {
+        return 0;
+    }
+};
+
+class FarthestFrameEviction : public ScanEvictionPolicy {
+    // odometry revisits the frames right behind the current one,
+    // so the scans farthest away in time are the least useful
+    public:
+    int victim(
+            const std::vector<int> &candidates,
+            const int frame) const {
+        int v = 0;
+        for(int i=1; i<candidates.size(); i++) {
+            if(std::abs(candidates[i] - frame) >
+                    std::abs(candidates[v] - frame)) {
+                v = i;
+            }
+        }
+        return v;
+    }
 };
 
+struct ScanCacheStats {
+    long long hits = 0, misses = 0, evictions = 0;
+    size_t bytes = 0, entries = 0;
+};
+
+// Scans are spread over shards by frame number, each with its own lock,
+// recency list and share of the budget, so that several threads
+// registering different frame pairs rarely contend.
+// Concurrent requests for a frame that is still being loaded wait
+// for that one load instead of constructing their own ScanData.
 class ScansLRU {
     private:
-    const int size = 50;
-    std::list<ScanData*> times;
-    std::unordered_map<int, decltype(times)::iterator> exists;
+    struct Shard {
+        std::mutex mutex;
+        std::list<ScanHandle> times;
+        std::unordered_map<int, std::list<ScanHandle>::iterator> exists;
+        std::unordered_map<int, std::shared_future<ScanHandle>> loading;
+        size_t bytes = 0;
+    };
+    const size_t budget;
+    std::shared_ptr<ScanEvictionPolicy> policy;
+    std::vector<Shard> shards;
+    std::atomic<long long> hits, misses, evictions;
+
+    Shard &shardOf(const int frame) {
+        return shards[frame % shards.size()];
+    }
+    void insert(Shard &sh, ScanHandle sd) {
+        // caller must hold sh.mutex
+        sh.times.push_front(sd);
+        sh.exists[sd->_frame] = sh.times.begin();
+        sh.bytes += sd->bytes();
+        evict(sh, sd->_frame);
+    }
+    void evict(Shard &sh, const int frame) {
+        // caller must hold sh.mutex
+        size_t shard_budget = budget / shards.size();
+        while(sh.bytes > shard_budget) {
+            // scans still in use outside of the cache are pinned
+            std::vector<int> candidates;
+            std::vector<std::list<ScanHandle>::iterator> its;
+            for(auto it = sh.times.rbegin(); it != sh.times.rend(); it++) {
+                if(it->use_count() == 1) {
+                    candidates.push_back((*it)->_frame);
+                    its.push_back(std::prev(it.base()));
+                }
+            }
+            if(candidates.empty()) {
+                // everything is pinned; over budget until released
+                return;
+            }
+            auto it = its[policy->victim(candidates, frame)];
+            sh.bytes -= (*it)->bytes();
+            evictions++;
+            sh.exists.erase((*it)->_frame);
+            sh.times.erase(it);
+        }
+    }
+
     public:
-    ScanData* get(const std::string dataset,
+    ScansLRU(
+            const size_t budget = size_t(scan_cache_budget_mb) << 20,
+            std::shared_ptr<ScanEvictionPolicy> policy =
+                std::make_shared<LRUEviction>(),
+            const int num_shards = scan_cache_shards
+            ) :
+        budget(budget),
+        policy(policy),
+        shards(num_shards),
+        hits(0),
+        misses(0),
+        evictions(0) {}
+
+    ScanHandle get(const std::string dataset,
             const int frame
             ) {
         // retrieves from scan if possible,
         // loads data from disk otherwise
-        if(exists.count(frame)) {
-            auto it = exists[frame];
-            ScanData *sd = *it;
-            times.erase(it);
-            times.push_front(sd);
-            return sd;
-        } else {
-            ScanData *sd = new ScanData(dataset, frame);
-            times.push_front(sd);
-            exists[frame] = times.begin();
-            if(times.size() > size) {
-                auto sd = times.back();
-                exists.erase(sd->_frame);
-                delete sd;
-                times.pop_back();
-            }
-            return sd;
+        Shard &sh = shardOf(frame);
+        std::unique_lock<std::mutex> lock(sh.mutex);
+        auto found = sh.exists.find(frame);
+        if(found != sh.exists.end()) {
+            hits++;
+            auto it = found->second;
+            sh.times.splice(sh.times.begin(), sh.times, it);
+            return *it;
+        }
+        auto pending = sh.loading.find(frame);
+        if(pending != sh.loading.end()) {
+            // someone else is already loading it
+            hits++;
+            std::shared_future<ScanHandle> f = pending->second;
+            lock.unlock();
+            return f.get();
         }
+        misses++;
+        std::promise<ScanHandle> promise;
+        sh.loading[frame] = promise.get_future().share();
+        lock.unlock();
+
+        ScanHandle sd;
+        try {
+            sd = std::make_shared<ScanData>(dataset, frame);
+        } catch(...) {
+            // don't leave the waiters hanging
+            lock.lock();
+            sh.loading.erase(frame);
+            lock.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        lock.lock();
+        sh.loading.erase(frame);
+        insert(sh, sd);
+        lock.unlock();
+        promise.set_value(sd);
+        return sd;
+    }
+    ScanCacheStats getStats() {
+        ScanCacheStats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.evictions = evictions;
+        for(auto &sh : shards) {
+            std::lock_guard<std::mutex> lock(sh.mutex);
+            s.bytes += sh.bytes;
+            s.entries += sh.times.size();
+        }
+        return s;
+    }
+    void printStats(std::ostream &out) {
+        ScanCacheStats s = getStats();
+        out << "Scan cache:"
+            << " hits " << s.hits
+            << " misses " << s.misses
+            << " evictions " << s.evictions
+            << " entries " << s.entries
+            << " MB " << (s.bytes >> 20)
+            << "/" << (budget >> 20)
+            << std::endl;
     }
 };
@@ -7,9 +7,27 @@
 #include <sstream>
 #include <iomanip>
 #include <cmath>
+#include <algorithm>
+#include <numeric>
 #include <list>
 #include <unordered_map>
+#include <memory>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include <Eigen/StdVector>
 #include <Eigen/Dense>
@@ -21,10 +39,6 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 
-#include <opencv2/core/cuda.hpp>
-#include <opencv2/cudaimgproc.hpp>
-#include <opencv2/cudafeatures2d.hpp>
-
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
 
@@ -45,19 +59,34 @@
 #define ENABLE_3D2D
 //#define ENABLE_ISAM
 //#define LOOP_CLOSURE
-#define USE_CUDA
+// descriptors are matched on the CPU unless this is defined
+//#define USE_CUDA
 //#define BUNDLE_ADJUST
+//#define CERES_POSE_SOLVER
+
+#ifdef USE_CUDA
+#include <opencv2/core/cuda.hpp>
+#include <opencv2/cudaimgproc.hpp>
+#include <opencv2/cudafeatures2d.hpp>
+#endif
 
 #include "my_slam_monocular.h"
 
 #include "utility.h"
+#include "threadpool.h"
 #include "kitti.h"
 #include "costfunctions.h"
+#include "framefeatures.h"
+#include "tracks.h"
+#include "scantree.h"
 #include "velo.h"
 #include "lru.h"
+#include "prefetch.h"
 
 
 int main(int argc, char** argv) {
+    gflags::SetUsageMessage("velo kittidatasetnumber [flags]. e.g. velo 00");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
     cv::setUseOptimized(true);
 
 #ifdef USE_CUDA
@@ -86,34 +115,15 @@ int main(int argc, char** argv) {
             quality_level,
             min_distance);
 
-    // tracked keypoints, camera canonical coordinates
-    std::vector<std::vector<std::vector<cv::Point2f>>> keypoints(num_cams,
-            std::vector<std::vector<cv::Point2f>>(num_frames));
-    // tracked keypoints, pixel coordinates
-    std::vector<std::vector<std::vector<cv::Point2f>>> keypoints_p(num_cams,
-            std::vector<std::vector<cv::Point2f>>(num_frames));
-    // IDs of keypoints
-    std::vector<std::vector<std::vector<int>>> keypoint_ids(num_cams,
-            std::vector<std::vector<int>>(num_frames));
-    // FREAK descriptors of each keypoint
-    std::vector<std::vector<cv::Mat>> descriptors(num_cams,
-            std::vector<cv::Mat>(num_frames));
-    // -1 if no depth, index of kp_with_depth otherwise
-    std::vector<std::vector<std::vector<int>>> has_depth(num_cams,
-            std::vector<std::vector<int>>(num_frames));
-    // interpolated lidar point, physical coordinates
-    std::vector<std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr>> kp_with_depth(
-            num_cams,
-            std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr>(num_frames));
     // images of current and frame, used for optical flow tracking
     std::vector<cv::Mat> imgs(num_cams);
     std::vector<cv::Mat> img_prevs(num_cams);
+    // optical flow pyramids of the above, built once per image
+    std::vector<std::vector<cv::Mat>> pyramids(num_cams);
+    std::vector<std::vector<cv::Mat>> pyramid_prevs(num_cams);
 
-    // vector which maps from keypoint id to observed position
-    // [keypoint_id][cam][frame] = observation
-    std::vector<std::vector<std::map<int, cv::Point2f>>> keypoint_obs2;
-    // [keypoint_id][cam][frame] = observation3
-    std::vector<std::vector<std::map<int, pcl::PointXYZ>>> keypoint_obs3;
+    // observed positions of each keypoint id, 2D or 3D, by cam and frame
+    TrackStore tracks;
     // number of observations for each keypoint_id
     std::vector<int> keypoint_obs_count;
 
@@ -140,6 +150,8 @@ int main(int argc, char** argv) {
     ceres_poses_mat[0] = Eigen::Matrix4d::Identity();
     // camera poses in axis angle rotation, translation
     std::vector<double[6]> ceres_poses_vec(num_frames);
+    // normal equations of the landmarks that are still tracked
+    std::unordered_map<int, LandmarkState> landmark_states;
     // set of world frame position of keypoints
     pcl::PointCloud<pcl::PointXYZ>::Ptr landmarks(
             new pcl::PointCloud<pcl::PointXYZ>);
@@ -159,9 +171,22 @@ int main(int argc, char** argv) {
     }
 #endif
 
+    // tracked keypoints, their ids, FREAK descriptors and depth,
+    // kept for as many frames as odometry looks back
+    int window = feature_window;
+    for(int dframe : dframes[0]) {
+        window = std::max(window, dframe + 1);
+    }
+#ifdef LOOP_CLOSURE
+    // loop closure can look back at any frame
+    FrameStore features(window, feature_spill_path + dataset + "/");
+#else
+    FrameStore features(window);
+#endif
+
 #ifdef VISUALIZE
-    char features[] = "features";
-    cvNamedWindow(features);
+    char features_window[] = "features";
+    cvNamedWindow(features_window);
     char depthassoc[] = "depthassoc";
     cvNamedWindow(depthassoc);
 #endif
@@ -169,6 +194,7 @@ int main(int argc, char** argv) {
     Eigen::Matrix4d pose = Eigen::Matrix4d::Identity();
     double transform[6] = {0, 0, 0, 0, 0, 1};
     ScansLRU lru;
+    FramePrefetcher prefetcher(lru, dataset, num_frames, prefetch_depth);
 
     // preliminaries for bundle adjustment
 #ifdef ENABLE_ISAM
@@ -213,80 +239,63 @@ int main(int argc, char** argv) {
         }
 #endif
 
-        ScanData *sd = lru.get(dataset, frame);
+        FrameData fd = prefetcher.next();
+        ScanHandle sd = fd.sd;
         const auto &scans = sd->scans;
         for(int cam = 0; cam<num_cams; cam++) {
-            imgs[cam] = loadImage(dataset, cam, frame);
+            imgs[cam] = fd.imgs[cam];
+            pyramids[cam] = fd.pyramids[cam];
         }
+        features.advance(frame);
         if(frame > 0) {
+            std::vector<TrackPair> pairs;
             for(int cam = 0; cam<num_cams; cam++) {
                 for(int prev_cam = 0; prev_cam < num_cams; prev_cam++) {
-                    trackFeatures(
-                            keypoints,
-                            keypoints_p,
-                            keypoint_ids,
-                            descriptors,
-                            img_prevs[prev_cam],
-                            imgs[cam],
+                    pairs.push_back({
                             prev_cam,
                             cam,
                             frame-1,
-                            frame);
+                            frame,
+                            &pyramid_prevs[prev_cam],
+                            &pyramids[cam]});
                 }
             }
+            trackFeatures(features, pairs);
             for(int cam = 0; cam<num_cams; cam++) {
-                consolidateFeatures(
-                        keypoints[cam][frame],
-                        keypoints_p[cam][frame],
-                        keypoint_ids[cam][frame],
-                        descriptors[cam][frame],
-                        cam);
+                FrameFeatures &f = features.at(cam, frame);
+                consolidateFeatures(f, cam);
 
                 removeTerribleFeatures(
-                        keypoints[cam][frame],
-                        keypoints_p[cam][frame],
-                        keypoint_ids[cam][frame],
-                        descriptors[cam][frame],
+                        f,
                         freak,
                         imgs[cam],
                         cam);
 
-                std::vector<std::vector<cv::Point2f>> projection;
-                std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> scans_valid;
-                projectLidarToCamera(scans, projection, scans_valid, cam);
-
-                kp_with_depth[cam][frame] =
-                    pcl::PointCloud<pcl::PointXYZ>::Ptr(
-                            new pcl::PointCloud<pcl::PointXYZ>);
-                featureDepthAssociation(scans_valid,
-                        projection,
-                        keypoints[cam][frame],
-                        kp_with_depth[cam][frame],
-                        has_depth[cam][frame]);
+                const RingProjection &projection = sd->projection(cam);
+
+                featureDepthAssociation(scans, projection, f);
 #ifdef VISUALIZE
                 if(cam == 0) {
                     cv::Mat draw;
                     cvtColor(imgs[cam], draw, cv::COLOR_GRAY2BGR);
                     auto &K = cam_intrinsic[cam];
-                    for(int s=0, _s = projection.size(); s<_s; s++) {
-                        auto P = projection[s];
-                        for(int ss=0; ss<projection[s].size(); ss++) {
-                            auto pp = canonical2pixel(projection[s][ss], K);
-                            auto PP = scans_valid[s]->at(ss);
-                            int D = 200;
-                            double d = sqrt(PP.z * 5/D) * D;
-                            if(d > D) d = D;
-                            cv::circle(draw, pp, 1,
-                                    cv::Scalar(0, D-d, d), -1, 8, 0);
-                        }
+                    for(int ss=0; ss<projection.size(); ss++) {
+                        auto pp = canonical2pixel(
+                                cv::Point2f(projection.u[ss], projection.v[ss]), K);
+                        auto PP = scans.point(projection.index[ss]);
+                        int D = 200;
+                        double d = sqrt(PP.z * 5/D) * D;
+                        if(d > D) d = D;
+                        cv::circle(draw, pp, 1,
+                                cv::Scalar(0, D-d, d), -1, 8, 0);
                     }
-                    for(int k=0; k<keypoints[cam][frame].size(); k++) {
-                        auto p = keypoints_p[cam][frame][k];
-                        int hd = has_depth[cam][frame][k];
+                    for(int k=0; k<f.size(); k++) {
+                        auto p = f.keypoints_p[k];
+                        int hd = f.has_depth[k];
                         if(hd != -1) {
                             int D = 255;
                             double d = sqrt(
-                                    kp_with_depth[cam][frame]->at(hd).z * 5/D) * D;
+                                    f.kp_with_depth->at(hd).z * 5/D) * D;
                             if(d > D) d = D;
                             cv::circle(draw, p, 4, cv::Scalar(0, 255-d, d), -1, 8, 0);
                             cv::circle(draw, p, 4, cv::Scalar(0, 0, 0), 1, 8, 0);
@@ -302,307 +311,352 @@ int main(int argc, char** argv) {
         }
         std::cerr << "Feature tracking done" << std::endl;
 
-        for(int ba = 0; ba < 2; ba++) {
-            for(int dframe : dframes[ba]) {
-                if(frame-dframe < 0) break;
-                // matches are what's fed into frameToFrame,
-                // good matches have outliers removed during optimization
-                Eigen::Matrix4d dT;
-                if(dframe == 1) {
-                    if(frame > 1) {
-                        //Eigen::Matrix4d T1 = cam_nodes[0][frame-2]->value().wTo();
-                        //Eigen::Matrix4d T2 = cam_nodes[0][frame-1]->value().wTo();
-                        auto T1 = ceres_poses_mat[frame-2];
-                        auto T2 = ceres_poses_mat[frame-1];
-                        dT = T1.inverse() * T2;
-                    } else {
-                        dT = util::pose_mat2vec(transform);
-                    }
-                } else {
-                    //Eigen::Matrix4d T1 = cam_nodes[0][frame-dframe]->value().wTo();
-                    //Eigen::Matrix4d T2 = cam_nodes[0][frame]->value().wTo();
-                    auto T1 = ceres_poses_mat[frame-dframe];
-                    auto T2 = ceres_poses_mat[frame];
+        // a registration of this frame against an earlier one,
+        // odometry for ba 0 and loop closure for ba 1
+        struct Registration {
+            int ba, dframe;
+            // stop means this and later dframes of ba aren't used
+            bool stop = false;
+            Eigen::Matrix4d dT, dpose;
+            double transform[6];
+            // matches are what's fed into frameToFrame,
+            // good matches have outliers removed during optimization
+            std::vector<std::vector<std::pair<int, int>>> matches;
+            std::vector<std::vector<std::pair<int, int>>> good_matches;
+            std::vector<std::vector<ResidualType>> residual_type;
+            double seconds = 0;
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        };
+        auto predict = [&](const int ba, const int dframe) {
+            std::unique_ptr<Registration> r(new Registration);
+            r->ba = ba;
+            r->dframe = dframe;
+            Eigen::Matrix4d &dT = r->dT;
+            if(dframe == 1) {
+                if(frame > 1) {
+                    //Eigen::Matrix4d T1 = cam_nodes[0][frame-2]->value().wTo();
+                    //Eigen::Matrix4d T2 = cam_nodes[0][frame-1]->value().wTo();
+                    auto T1 = ceres_poses_mat[frame-2];
+                    auto T2 = ceres_poses_mat[frame-1];
                     dT = T1.inverse() * T2;
-                }
-                if(ba == 1) {
-                    dT(1,3) /= 20;
-                }
-                util::pose_vec2mat(dT, transform);
-                std::vector<std::vector<std::pair<int, int>>> matches(num_cams);
-                std::vector<std::vector<std::pair<int, int>>> good_matches(num_cams);
-                std::vector<std::vector<ResidualType>> residual_type(num_cams);
-
-                // if attempting loop closure,
-                // check if things are close by
-                if(ba == 1) {
-                    Eigen::Vector3d le_dist; le_dist << transform[3], transform[4], transform[5];
-                    if(le_dist.norm() > loop_close_thresh) {
-                        continue;
-                    } else {
-                        std::cerr << "Loop closure plausible" << std::endl;
-                    }
-                }
-                std::cerr << "Computing f2f pose: "
-                    << " " << frame-dframe << "-" << frame
-                    << " ba=" << ba << std::endl;
-                sd = lru.get(dataset, frame);
-                ScanData *sd_prev = lru.get(dataset, frame - dframe);
-                if(ba == 0) {
-                    matchUsingId(keypoint_ids, frame, frame-dframe, matches);
-                    std::cerr << "Matches using id: ";
-                    for(int zxcv=0; zxcv<num_cams; zxcv++) {
-                        std::cerr << matches[zxcv].size() << " ";
-                    }
-                    std::cerr << std::endl;
                 } else {
-                    matchFeatures(descriptors, frame, frame-dframe, matches);
-                    std::cerr << "Matches using descriptors: ";
-                    for(int zxcv=0; zxcv<num_cams; zxcv++) {
-                        std::cerr << matches[zxcv].size() << " ";
-                    }
-                    std::cerr << std::endl;
-                }
-                if(dframe > 1 && matches[0].size() < min_matches) break;
-                bool enable_icp = ba;
-                if(matches[0].size() < 100) {
-                    if(ba == 0 && dframe != 1) break;
-                    enable_icp = true;
-                }
-                std::cerr << "Predicted: ";
-                for(int i=0; i<6; i++) std::cerr << transform[i] << " ";
-                std::cerr << std::endl;
-
-                std::map<int, pcl::PointXYZ> landmarks_at_frame;
-                // get triangulated landmarks
-                std::cerr << "Getting triangulated landmarks at frame "
-                    << frame-dframe << std::endl;
-                getLandmarksAtFrame(
-                        ceres_poses_mat[frame-dframe],
-                        landmarks,
-                        keypoint_added,
-                        keypoint_ids,
-                        frame-dframe,
-                        landmarks_at_frame);
-                auto start = clock() / double(CLOCKS_PER_SEC);
-                Eigen::Matrix4d dpose = frameToFrame(
-                        matches,
-                        keypoints,
-                        keypoint_ids,
-                        landmarks_at_frame,
-                        kp_with_depth,
-                        has_depth,
-                        sd->scans,
-                        sd_prev->scans,
-                        sd_prev->trees,
-                        frame,
-                        frame-dframe,
-                        transform,
-                        good_matches,
-                        residual_type,
-                        //ba);
-                        true);
-                        //enable_icp);
-                auto end = clock() / double(CLOCKS_PER_SEC);
-                if(dframe == 1) {
-                    ceres_poses_mat[frame] = ceres_poses_mat[frame-1] * dpose;
-                    util::pose_vec2mat(ceres_poses_mat[frame], ceres_poses_vec[frame]);
-                }
-                std::cerr << "Optimized (t=" << end - start << "): ";
-                for(int i=0; i<6; i++) std::cerr << transform[i] << " ";
-                std::cerr << std::endl;
-
-                // check agreement
-                double agreement[6];
-                util::pose_vec2mat(dpose * dT.inverse(), agreement);
-                std::cerr << "Agreement: ";
-                for(int i=0; i<6; i++) std::cerr << agreement[i] << " ";
-                std::cerr << std::endl;
-                Eigen::Vector3d agreement_t;
-                agreement_t << agreement[3], agreement[4], agreement[5];
-                Eigen::Vector3d agreement_r;
-                agreement_r << agreement[0], agreement[1], agreement[2];
-
-                if(ba == 0 && agreement_t.norm() >
-                        std::min(agreement_t_thresh * dframe, loop_close_thresh)
-                        && dframe > 1) {
-                    std::cerr << "Poor t agreement: " << agreement_t.norm()
-                        << " " << agreement_t_thresh << " " << dframe
-                        << std::endl;
-                    continue;
+                    dT = util::pose_mat2vec(transform);
                 }
-                if(agreement_r.norm() > agreement_r_thresh && dframe > 1) {
-                    std::cerr << "Poor r agreement" << std::endl;
-                    continue;
+            } else {
+                //Eigen::Matrix4d T1 = cam_nodes[0][frame-dframe]->value().wTo();
+                //Eigen::Matrix4d T2 = cam_nodes[0][frame]->value().wTo();
+                auto T1 = ceres_poses_mat[frame-dframe];
+                auto T2 = ceres_poses_mat[frame];
+                dT = T1.inverse() * T2;
+            }
+            if(ba == 1) {
+                dT(1,3) /= 20;
+            }
+            util::pose_vec2mat(dT, r->transform);
+            // if attempting loop closure,
+            // check if things are close by
+            if(ba == 1) {
+                Eigen::Vector3d le_dist;
+                le_dist << r->transform[3], r->transform[4], r->transform[5];
+                if(le_dist.norm() > loop_close_thresh) {
+                    r.reset();
+                } else {
+                    std::cerr << "Loop closure plausible" << std::endl;
                 }
-                if(ba == 1) {
-                    std::cerr << "Loop closed!" << std::endl;
+            }
+            return r;
+        };
+        // only reads the shared state, so any number can run at once
+        auto registerFrames = [&](Registration &r) {
+            const int ba = r.ba, dframe = r.dframe;
+            r.matches.resize(num_cams);
+            r.good_matches.resize(num_cams);
+            r.residual_type.resize(num_cams);
+            ScanHandle scan = lru.get(dataset, frame);
+            ScanHandle scan_prev = lru.get(dataset, frame - dframe);
+            if(ba == 0) {
+                matchUsingId(features, frame, frame-dframe, r.matches);
+            } else {
+                // the predicted pose narrows down the candidates
+                matchFeatures(features, frame, frame-dframe, r.matches,
+                        r.transform);
+            }
+            if(dframe > 1 && r.matches[0].size() < min_matches) {
+                r.stop = true;
+                return;
+            }
+            bool enable_icp = ba;
+            if(r.matches[0].size() < 100) {
+                if(ba == 0 && dframe != 1) {
+                    r.stop = true;
+                    return;
                 }
+                enable_icp = true;
+            }
+
+            std::map<int, pcl::PointXYZ> landmarks_at_frame;
+            // get triangulated landmarks
+            getLandmarksAtFrame(
+                    ceres_poses_mat[frame-dframe],
+                    landmarks,
+                    keypoint_added,
+                    features,
+                    frame-dframe,
+                    landmarks_at_frame);
+            auto start = std::chrono::steady_clock::now();
+            r.dpose = frameToFrame(
+                    r.matches,
+                    features,
+                    landmarks_at_frame,
+                    scan->scans,
+                    scan_prev->scans,
+                    scan_prev->tree,
+                    frame,
+                    frame-dframe,
+                    r.transform,
+                    r.good_matches,
+                    r.residual_type,
+                    //ba);
+                    true);
+                    //enable_icp);
+            r.seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+        };
+        // returns whether later dframes of the same ba are still wanted
+        auto apply = [&](Registration &r) {
+            const int ba = r.ba, dframe = r.dframe;
+            const Eigen::Matrix4d &dT = r.dT, &dpose = r.dpose;
+            const auto &matches = r.matches;
+            const auto &good_matches = r.good_matches;
+            const auto &residual_type = r.residual_type;
+            std::cerr << "Computing f2f pose: "
+                << " " << frame-dframe << "-" << frame
+                << " ba=" << ba << std::endl;
+            std::cerr << (ba == 0 ? "Matches using id: " : "Matches using descriptors: ");
+            for(int zxcv=0; zxcv<num_cams; zxcv++) {
+                std::cerr << matches[zxcv].size() << " ";
+            }
+            std::cerr << std::endl;
+            if(r.stop) return false;
+            double predicted[6];
+            util::pose_vec2mat(dT, predicted);
+            std::cerr << "Predicted: ";
+            for(int i=0; i<6; i++) std::cerr << predicted[i] << " ";
+            std::cerr << std::endl;
+
+            std::copy(r.transform, r.transform + 6, transform);
+            if(dframe == 1) {
+                ceres_poses_mat[frame] = ceres_poses_mat[frame-1] * dpose;
+                util::pose_vec2mat(ceres_poses_mat[frame], ceres_poses_vec[frame]);
+            }
+            std::cerr << "Optimized (t=" << r.seconds << "): ";
+            for(int i=0; i<6; i++) std::cerr << transform[i] << " ";
+            std::cerr << std::endl;
+
+            // check agreement
+            double agreement[6];
+            util::pose_vec2mat(dpose * dT.inverse(), agreement);
+            std::cerr << "Agreement: ";
+            for(int i=0; i<6; i++) std::cerr << agreement[i] << " ";
+            std::cerr << std::endl;
+            Eigen::Vector3d agreement_t;
+            agreement_t << agreement[3], agreement[4], agreement[5];
+            Eigen::Vector3d agreement_r;
+            agreement_r << agreement[0], agreement[1], agreement[2];
+
+            if(ba == 0 && agreement_t.norm() >
+                    std::min(agreement_t_thresh * dframe, loop_close_thresh)
+                    && dframe > 1) {
+                std::cerr << "Poor t agreement: " << agreement_t.norm()
+                    << " " << agreement_t_thresh << " " << dframe
+                    << std::endl;
+                return true;
+            }
+            if(agreement_r.norm() > agreement_r_thresh && dframe > 1) {
+                std::cerr << "Poor r agreement" << std::endl;
+                return true;
+            }
+            if(ba == 1) {
+                std::cerr << "Loop closed!" << std::endl;
+            }
 
 #ifdef VISUALIZE
-                if(dframe == 1) {
-                    std::vector<cv::Mat> draws(num_cams);
-                    for(int cam=0; cam<num_cams; cam++) {
-                        cv::Mat draw;
-                        cvtColor(imgs[cam], draw, cv::COLOR_GRAY2BGR);
-                        auto &K = cam_intrinsic[cam];
-                        //cv::drawKeypoints(img, keypoints[frame], draw);
-                        for(int k=0; k<keypoints[cam][frame].size(); k++) {
-                            auto p = keypoints_p[cam][frame][k];
-                            if(has_depth[cam][frame][k] != -1) {
-                                cv::circle(draw, p, 4, cv::Scalar(0, 0, 100), -1, 8, 0);
-                            } else {
-                                cv::circle(draw, p, 4, cv::Scalar(100, 0, 0), -1, 8, 0);
-                            }
+            if(dframe == 1) {
+                std::vector<cv::Mat> draws(num_cams);
+                for(int cam=0; cam<num_cams; cam++) {
+                    cv::Mat draw;
+                    cvtColor(imgs[cam], draw, cv::COLOR_GRAY2BGR);
+                    auto &K = cam_intrinsic[cam];
+                    const FrameFeatures &f = features.at(cam, frame),
+                          &f_prev = features.at(cam, frame-dframe);
+                    //cv::drawKeypoints(img, f.keypoints, draw);
+                    for(int k=0; k<f.size(); k++) {
+                        auto p = f.keypoints_p[k];
+                        if(f.has_depth[k] != -1) {
+                            cv::circle(draw, p, 4, cv::Scalar(0, 0, 100), -1, 8, 0);
+                        } else {
+                            cv::circle(draw, p, 4, cv::Scalar(100, 0, 0), -1, 8, 0);
                         }
+                    }
 
-                        for(auto m : matches[cam]) {
-                            auto p1 = keypoints_p[cam][frame][m.first];
-                            auto p2 = keypoints_p[cam][frame-dframe][m.second];
-                            cv::arrowedLine(draw, p1, p2,
-                                    cv::Scalar(0, 0, 0), 1, CV_AA);
-                        }
+                    for(auto m : matches[cam]) {
+                        auto p1 = f.keypoints_p[m.first];
+                        auto p2 = f_prev.keypoints_p[m.second];
+                        cv::arrowedLine(draw, p1, p2,
+                                cv::Scalar(0, 0, 0), 1, CV_AA);
+                    }
 
-                        for(int i=0; i<good_matches[cam].size(); i++) {
-                            auto m = good_matches[cam][i];
-                            auto p1 = keypoints_p[cam][frame][m.first];
-                            auto p2 = keypoints_p[cam][frame-dframe][m.second];
-                            cv::Scalar color = cv::Scalar(0, 0, 0);
-                            switch(residual_type[cam][i]) {
-                                case RESIDUAL_3D3D:
-                                    color = cv::Scalar(0, 100, 255);
-                                    break;
-                                case RESIDUAL_3D2D:
-                                case RESIDUAL_2D3D:
-                                    color = cv::Scalar(0, 230, 255);
-                                    break;
-                                case RESIDUAL_2D2D:
-                                    color = cv::Scalar(255, 200, 0);
-                                    break;
-                            }
-                            cv::arrowedLine(draw, p1, p2,
-                                    color, 2, CV_AA);
+                    for(int i=0; i<good_matches[cam].size(); i++) {
+                        auto m = good_matches[cam][i];
+                        auto p1 = f.keypoints_p[m.first];
+                        auto p2 = f_prev.keypoints_p[m.second];
+                        cv::Scalar color = cv::Scalar(0, 0, 0);
+                        switch(residual_type[cam][i]) {
+                            case RESIDUAL_3D3D:
+                                color = cv::Scalar(0, 100, 255);
+                                break;
+                            case RESIDUAL_3D2D:
+                            case RESIDUAL_2D3D:
+                                color = cv::Scalar(0, 230, 255);
+                                break;
+                            case RESIDUAL_2D2D:
+                                color = cv::Scalar(255, 200, 0);
+                                break;
                         }
+                        cv::arrowedLine(draw, p1, p2,
+                                color, 2, CV_AA);
+                    }
 
-                        // Draw stereo matches
-                        std::vector<std::pair<int, int>> intercamera_matches;
-                        matchUsingId(keypoint_ids, 0, 1, frame, frame,
-                                intercamera_matches);
-                        for(auto m : intercamera_matches) {
-                            auto p1 = keypoints_p[0][frame][m.first];
-                            auto p2 = keypoints_p[1][frame][m.second];
-                            cv::line(draw, p1, p2, cv::Scalar(255, 0, 255), 1, CV_AA);
-                        }
-                        draw.copyTo(draws[cam]);
+                    // Draw stereo matches
+                    std::vector<std::pair<int, int>> intercamera_matches;
+                    matchUsingId(features, 0, 1, frame, frame,
+                            intercamera_matches);
+                    for(auto m : intercamera_matches) {
+                        auto p1 = features.at(0, frame).keypoints_p[m.first];
+                        auto p2 = features.at(1, frame).keypoints_p[m.second];
+                        cv::line(draw, p1, p2, cv::Scalar(255, 0, 255), 1, CV_AA);
                     }
-                    cv::Mat D;
-                    vconcat(draws[0], draws[1], D);
-                    cv::imshow(features, D);
-                    cvWaitKey(1);
+                    draw.copyTo(draws[cam]);
                 }
+                cv::Mat D;
+                vconcat(draws[0], draws[1], D);
+                cv::imshow(features_window, D);
+                cvWaitKey(1);
+            }
 #endif
-                if(dframe == 1) {
-                    removeSlightlyLessTerribleFeatures(
-                            keypoints,
-                            keypoints_p,
-                            kp_with_depth,
-                            keypoint_ids,
-                            descriptors,
-                            has_depth,
-                            frame,
-                            good_matches);
-                }
+            if(dframe == 1) {
+                removeSlightlyLessTerribleFeatures(
+                        features,
+                        frame,
+                        good_matches);
+            }
 
 #ifdef ENABLE_ISAM
-                // iSAM time!
-                isam::Pose3d_Pose3d_Factor* odom_factor =
+            // iSAM time!
+            isam::Pose3d_Pose3d_Factor* odom_factor =
+                new isam::Pose3d_Pose3d_Factor(
+                        cam_nodes[0][frame-dframe],
+                        cam_nodes[0][frame],
+                        isam::Pose3d(dpose),
+                        noisy6
+                        );
+            slam.add_factor(odom_factor);
+            for(int cam = 1; cam<num_cams; cam++) {
+                isam::Pose3d_Pose3d_Factor* cam_factor =
                     new isam::Pose3d_Pose3d_Factor(
-                            cam_nodes[0][frame-dframe],
                             cam_nodes[0][frame],
-                            isam::Pose3d(dpose),
-                            noisy6
+                            cam_nodes[cam][frame],
+                            isam::Pose3d(cam_pose[cam].cast<double>()),
+                            noiseless6
                             );
-                slam.add_factor(odom_factor);
-                for(int cam = 1; cam<num_cams; cam++) {
-                    isam::Pose3d_Pose3d_Factor* cam_factor =
-                        new isam::Pose3d_Pose3d_Factor(
-                                cam_nodes[0][frame],
-                                cam_nodes[cam][frame],
-                                isam::Pose3d(cam_pose[cam].cast<double>()),
-                                noiseless6
-                                );
-                    slam.add_factor(cam_factor);
-                }
-                slam.update();
+                slam.add_factor(cam_factor);
+            }
+            slam.update();
+            return true;
 #else
-                break;
+            return false;
 #endif
+        };
+
+        // dframe 1 is registered and applied on its own first, since
+        // the other predictions start from its pose and it prunes the
+        // features they match. the rest only read shared state, so
+        // they run concurrently and are applied in order afterwards
+        std::vector<std::unique_ptr<Registration>> registrations;
+        for(int ba = 0; ba < 2; ba++) {
+            for(int dframe : dframes[ba]) {
+                if(frame-dframe < 0) break;
+                std::unique_ptr<Registration> r = predict(ba, dframe);
+                if(!r) continue;
+                if(ba == 0 && dframe == 1) {
+                    registerFrames(*r);
+                    if(!apply(*r)) break;
+                } else {
+                    registrations.push_back(std::move(r));
+                }
             }
         }
+        std::vector<std::future<void>> registered;
+        for(int i=1; i<registrations.size(); i++) {
+            Registration *r = registrations[i].get();
+            registered.push_back(thread_pool.submit([&registerFrames, r] {
+                        registerFrames(*r);
+                        }));
+        }
+        if(!registrations.empty()) {
+            registerFrames(*registrations[0]);
+        }
+        bool stopped[2] = {false, false};
+        for(int i=0; i<registrations.size(); i++) {
+            if(i > 0) registered[i-1].get();
+            Registration &r = *registrations[i];
+            if(stopped[r.ba]) continue;
+            stopped[r.ba] = !apply(r);
+        }
 
         // Detect new features
         sd = lru.get(dataset, frame);
         for(int cam = 0; cam<num_cams; cam++) {
             if(frame % detect_every == 0) {
                 detectFeatures(
-                        keypoints[cam],
-                        keypoints_p[cam],
-                        keypoint_ids[cam],
-                        descriptors[cam],
+                        features.at(cam, frame),
                         gftt,
                         freak,
                         imgs[cam],
                         id_counter,
-                        cam,
-                        frame);
+                        cam);
                 if(cam == 0) {
+                    std::vector<TrackPair> pairs;
                     for(int other_cam = 0; other_cam < num_cams; other_cam++) {
                         if(other_cam == cam) continue;
-                        trackFeatures(
-                                keypoints,
-                                keypoints_p,
-                                keypoint_ids,
-                                descriptors,
-                                imgs[cam],
-                                imgs[other_cam],
+                        pairs.push_back({
                                 cam,
                                 other_cam,
                                 frame,
-                                frame);
+                                frame,
+                                &pyramids[cam],
+                                &pyramids[other_cam]});
                     }
+                    trackFeatures(features, pairs);
                 }
             }
         }
         for(int cam = 0; cam<num_cams; cam++) {
             //std::cerr << "inter frame tracked" << std::endl;
             // TODO: don't do this twice
-            consolidateFeatures(
-                    keypoints[cam][frame],
-                    keypoints_p[cam][frame],
-                    keypoint_ids[cam][frame],
-                    descriptors[cam][frame],
-                    cam);
+            FrameFeatures &f = features.at(cam, frame);
+            consolidateFeatures(f, cam);
 
             removeTerribleFeatures(
-                    keypoints[cam][frame],
-                    keypoints_p[cam][frame],
-                    keypoint_ids[cam][frame],
-                    descriptors[cam][frame],
+                    f,
                     freak,
                     imgs[cam],
                     cam);
-            std::vector<std::vector<cv::Point2f>> projection;
-            std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> scans_valid;
-            projectLidarToCamera(sd->scans, projection, scans_valid, cam);
-
-            kp_with_depth[cam][frame].reset();
-            kp_with_depth[cam][frame] = pcl::PointCloud<pcl::PointXYZ>::Ptr(new pcl::PointCloud<pcl::PointXYZ>);
-            featureDepthAssociation(scans_valid,
-                    projection,
-                    keypoints[cam][frame],
-                    kp_with_depth[cam][frame],
-                    has_depth[cam][frame]);
+            const RingProjection &projection = sd->projection(cam);
+
+            featureDepthAssociation(sd->scans, projection, f);
             img_prevs[cam] = imgs[cam];
+            pyramid_prevs[cam] = pyramids[cam];
         }
 
 #ifdef ENABLE_ISAM
@@ -615,13 +669,11 @@ int main(int argc, char** argv) {
         landmarks->resize(id_counter+1);
         keypoint_obs_count_hist[0] += id_counter+1 - keypoint_obs_count.size();
         keypoint_obs_count.resize(id_counter+1, 0);
-        keypoint_obs2.resize(id_counter+1,
-                std::vector<std::map<int, cv::Point2f>>(num_cams));
-        keypoint_obs3.resize(id_counter+1,
-                std::vector<std::map<int, pcl::PointXYZ>>(num_cams));
+        tracks.resize(id_counter+1);
         for(int cam=0; cam<num_cams; cam++) {
-            for(int i=0; i<keypoints[cam][frame].size(); i++) {
-                int id = keypoint_ids[cam][frame][i];
+            const FrameFeatures &f = features.at(cam, frame);
+            for(int i=0; i<f.size(); i++) {
+                int id = f.ids[i];
                 keypoint_obs_count[id]++;
                 int koc = keypoint_obs_count[id];
                 if(koc >= keypoint_obs_count_hist.size()) {
@@ -630,15 +682,15 @@ int main(int argc, char** argv) {
                 keypoint_obs_count_hist[koc-1]--;
                 keypoint_obs_count_hist[koc]++;
                 /*
-                   std::cerr << i << "," << has_depth[cam][frame][i] 
-                   << "/" << keypoints[cam][frame].size()
+                   std::cerr << i << "," << f.has_depth[i]
+                   << "/" << f.size()
                    << " " << std::endl;
                    */
-                if(has_depth[cam][frame][i] == -1) {
-                    keypoint_obs2[id][cam][frame] = keypoints[cam][frame][i];
+                if(f.has_depth[i] == -1) {
+                    tracks.add(id, frame, cam, f.keypoints[i]);
                 } else {
-                    keypoint_obs3[id][cam][frame] = kp_with_depth[cam][frame]->at(
-                            has_depth[cam][frame][i]);
+                    tracks.add(id, frame, cam, f.kp_with_depth->at(
+                                f.has_depth[i]));
                 }
             }
             //std::cerr << std::endl;
@@ -653,21 +705,38 @@ int main(int argc, char** argv) {
 
         std::set<int> ids_seen;
         for(int cam=0; cam<num_cams; cam++) {
-            for(int i=0; i<keypoints[cam][frame].size(); i++) {
-                int id = keypoint_ids[cam][frame][i];
+            for(int id : features.at(cam, frame).ids) {
                 ids_seen.insert(id);
             }
         }
+        // ids are only ever carried over from the previous frame,
+        // so keypoints lost since then won't be observed again
+        if(frame > 0) {
+            for(int cam=0; cam<num_cams; cam++) {
+                for(int id : features.at(cam, frame-1).ids) {
+                    if(ids_seen.count(id)) continue;
+                    tracks.retire(id);
+                    landmark_states.erase(id);
+                }
+            }
+        }
+        std::vector<int> ids_triangulate;
+        std::vector<LandmarkState*> states_triangulate;
         for(auto id : ids_seen) {
             if(keypoint_obs_count[id] < 3) {
                 continue;
             }
-            triangulatePoint(
-                    keypoint_obs2[id],
-                    keypoint_obs3[id],
-                    ceres_poses_vec,
-                    landmarks->at(id),
-                    keypoint_added[id]);
+            ids_triangulate.push_back(id);
+            states_triangulate.push_back(&landmark_states[id]);
+        }
+        triangulatePoints(
+                tracks,
+                ids_triangulate,
+                ceres_poses_vec,
+                *landmarks,
+                keypoint_added,
+                states_triangulate);
+        for(auto id : ids_triangulate) {
             //std::cerr << "Triangulating " << id << ": " << landmarks->at(id) << std::endl;
             if(!keypoint_added[id]) {
 #ifdef ENABLE_ISAM
@@ -679,48 +748,46 @@ int main(int argc, char** argv) {
             }
 #ifdef ENABLE_ISAM
 #ifdef BUNDLE_ADJUST
-            for(int cam=0; cam<num_cams; cam++) {
-                for(auto obs3 : keypoint_obs3[id][cam]) {
-                    if(added_to_isam_3d[cam][obs3.first].count(id)) {
-                        continue;
-                    }
-                    isam::Noise noise3 = isam::Information(1 * isam::eye(3));
-                    auto p3 = obs3.second;
-                    Eigen::Vector3d point3d = p3.getVector3fMap().cast<double>();
-                    isam::Pose3d_Point3d_Factor* factor =
-                        new isam::Pose3d_Point3d_Factor(
-                                // 3D points always in cam 0 frame
-                                cam_nodes[0][obs3.first], 
-                                point_nodes[id],
-                                isam::Point3d(point3d),
-                                noise3
+            tracks.forEach(id, [&](const Observation &obs) {
+                    int cam = obs.cam;
+                    if(obs.depth) {
+                        if(added_to_isam_3d[cam][obs.frame].count(id)) {
+                            return;
+                        }
+                        isam::Noise noise3 = isam::Information(1 * isam::eye(3));
+                        auto p3 = obs.point3();
+                        Eigen::Vector3d point3d = p3.getVector3fMap().cast<double>();
+                        isam::Pose3d_Point3d_Factor* factor =
+                            new isam::Pose3d_Point3d_Factor(
+                                    // 3D points always in cam 0 frame
+                                    cam_nodes[0][obs.frame],
+                                    point_nodes[id],
+                                    isam::Point3d(point3d),
+                                    noise3
+                                    );
+                        slam.add_factor(factor);
+                        added_to_isam_3d[cam][obs.frame][id] = factor;
+                    } else {
+                        if(added_to_isam_2d[cam][obs.frame].count(id)) {
+                            return;
+                        }
+                        isam::MonocularMeasurement measurement(
+                                obs.x,
+                                obs.y
                                 );
-                    slam.add_factor(factor);
-                    added_to_isam_3d[cam][obs3.first][id] = factor;
-                }
-            }
-            for(int cam=0; cam<num_cams; cam++) {
-                for(auto obs2 : keypoint_obs2[id][cam]) {
-                    if(added_to_isam_2d[cam][obs2.first].count(id)) {
-                        continue;
+                        isam::Noise noise2 = isam::Information(1 * isam::eye(2));
+                        isam::Monocular_Factor* factor =
+                            new isam::Monocular_Factor(
+                                    cam_nodes[cam][obs.frame],
+                                    point_nodes[id],
+                                    &(monoculars[cam]),
+                                    measurement,
+                                    noise2
+                                    );
+                        slam.add_factor(factor);
+                        added_to_isam_2d[cam][obs.frame][id] = factor;
                     }
-                    isam::MonocularMeasurement measurement(
-                            obs2.second.x,
-                            obs2.second.y
-                            );
-                    isam::Noise noise2 = isam::Information(1 * isam::eye(2));
-                    isam::Monocular_Factor* factor =
-                        new isam::Monocular_Factor(
-                                cam_nodes[cam][obs2.first],
-                                point_nodes[id],
-                                &(monoculars[cam]),
-                                measurement,
-                                noise2
-                                );
-                    slam.add_factor(factor);
-                    added_to_isam_2d[cam][obs2.first][id] = factor;
-                }
-            }
+                    });
 #endif
 #endif
         }
@@ -762,6 +829,9 @@ int main(int argc, char** argv) {
         }
         output.close();
 #endif
+        lru.printStats(std::cerr);
+        features.printStats(std::cerr);
+        std::cerr << "Track store: MB " << (tracks.bytes() >> 20) << std::endl;
         std::cerr << "Frame complete: " << frame << std::endl;
     }
     return 0;
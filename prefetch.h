@@ -0,0 +1,79 @@
+#pragma once
+
+// Loads frames ahead of the main loop on a background thread,
+// so that disk I/O, PNG decoding, optical flow pyramids,
+// ring segmentation and kd tree construction for frames N+1..N+k
+// overlap with processing frame N.
+struct FrameData {
+    int frame;
+    ScanHandle sd; // already inserted into the cache
+    std::vector<cv::Mat> imgs;
+    std::vector<std::vector<cv::Mat>> pyramids;
+};
+
+class FramePrefetcher {
+    private:
+    ScansLRU &lru;
+    const std::string dataset;
+    const int num_frames, depth;
+    std::deque<FrameData> queue;
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+    bool stopping = false;
+    std::thread loader;
+
+    void run() {
+        for(int frame = 0; frame < num_frames; frame++) {
+            FrameData fd;
+            fd.frame = frame;
+            fd.sd = lru.get(dataset, frame);
+            fd.pyramids.resize(num_cams);
+            for(int cam = 0; cam<num_cams; cam++) {
+                fd.imgs.push_back(readImage(dataset, cam, frame));
+                buildPyramid(fd.imgs[cam], fd.pyramids[cam]);
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this] {
+                    return stopping || queue.size() < depth;
+                    });
+            if(stopping) {
+                return;
+            }
+            queue.push_back(fd);
+            not_empty.notify_one();
+        }
+    }
+
+    public:
+    FramePrefetcher(
+            ScansLRU &lru,
+            const std::string dataset,
+            const int num_frames,
+            const int depth
+            ) :
+        lru(lru),
+        dataset(dataset),
+        num_frames(num_frames),
+        depth(depth) {
+        loader = std::thread(&FramePrefetcher::run, this);
+    }
+    ~FramePrefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        not_full.notify_all();
+        loader.join();
+    }
+    FrameData next() {
+        // blocks until the next frame in sequence has been loaded
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] {
+                return !queue.empty();
+                });
+        FrameData fd = queue.front();
+        queue.pop_front();
+        not_full.notify_one();
+        return fd;
+    }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+// Result of ScanTree::nearestOnTwoRings: the nearest point of the
+// scan, and the nearest point on any ring other than the first's.
+// Indices are into the whole scan, -1 if none is within the radius
+struct RingNeighbors {
+    int first = -1, second = -1;
+    int first_ring = -1, second_ring = -1;
+    float first_dist, second_dist;
+};
+
+// Static kd-tree over every point of a RingScan, built once per scan.
+// The points are copied in tree order next to their ring and their
+// index in the scan, so a leaf is a contiguous run of each array and
+// nodes are laid out depth first with the left child right after its
+// parent. Subtrees are skipped using the incremental distance to
+// their cell, like nanoflann.
+class ScanTree {
+    private:
+    struct Node {
+        // a leaf if left == -1, otherwise split along dim
+        int begin, end, left = -1, right = -1, dim;
+        float split;
+    };
+    std::vector<Node> nodes;
+    std::vector<float> x, y, z;
+    std::vector<int> ring, index;
+
+    struct BuildPoint {
+        float p[3];
+        int index;
+    };
+    int build(std::vector<BuildPoint> &points, const int begin, const int end) {
+        int n = nodes.size();
+        nodes.push_back(Node());
+        nodes[n].begin = begin;
+        nodes[n].end = end;
+        if(end - begin <= scan_tree_leaf) return n;
+        // split the widest side of the bounding box at the median
+        float lo[3], hi[3];
+        for(int d=0; d<3; d++) {
+            lo[d] = hi[d] = points[begin].p[d];
+        }
+        for(int i=begin+1; i<end; i++) {
+            for(int d=0; d<3; d++) {
+                lo[d] = std::min(lo[d], points[i].p[d]);
+                hi[d] = std::max(hi[d], points[i].p[d]);
+            }
+        }
+        int dim = 0;
+        for(int d=1; d<3; d++) {
+            if(hi[d] - lo[d] > hi[dim] - lo[dim]) dim = d;
+        }
+        int mid = (begin + end) / 2;
+        std::nth_element(points.begin() + begin, points.begin() + mid,
+                points.begin() + end, [dim](const BuildPoint &a, const BuildPoint &b) {
+                return a.p[dim] < b.p[dim];
+                });
+        float split = points[mid].p[dim];
+        int left = build(points, begin, mid);
+        int right = build(points, mid, end);
+        nodes[n].left = left;
+        nodes[n].right = right;
+        nodes[n].dim = dim;
+        nodes[n].split = split;
+        return n;
+    }
+    void search(const int n, const float q[3], float offset[3],
+            const float cell_dist, RingNeighbors &nb) const {
+        // cell_dist is the squared distance from q to node n's cell
+        const Node &node = nodes[n];
+        if(node.left == -1) {
+            for(int i=node.begin; i<node.end; i++) {
+                float dx = x[i] - q[0], dy = y[i] - q[1], dz = z[i] - q[2],
+                      d = dx*dx + dy*dy + dz*dz;
+                if(d >= nb.second_dist) continue;
+                if(d < nb.first_dist) {
+                    // the old first is on another ring, or the second
+                    // already is and stays the nearest of the others
+                    if(ring[i] != nb.first_ring) {
+                        nb.second = nb.first;
+                        nb.second_ring = nb.first_ring;
+                        nb.second_dist = nb.first_dist;
+                    }
+                    nb.first = index[i];
+                    nb.first_ring = ring[i];
+                    nb.first_dist = d;
+                } else if(ring[i] != nb.first_ring) {
+                    nb.second = index[i];
+                    nb.second_ring = ring[i];
+                    nb.second_dist = d;
+                }
+            }
+            return;
+        }
+        float diff = q[node.dim] - node.split;
+        int near = diff < 0 ? node.left : node.right,
+            far = diff < 0 ? node.right : node.left;
+        search(near, q, offset, cell_dist, nb);
+        // neither point can improve beyond second_dist
+        float far_dist = cell_dist - offset[node.dim] * offset[node.dim]
+            + diff * diff;
+        if(far_dist < nb.second_dist) {
+            float saved = offset[node.dim];
+            offset[node.dim] = diff;
+            search(far, q, offset, far_dist, nb);
+            offset[node.dim] = saved;
+        }
+    }
+
+    public:
+    void build(const RingScan &scan) {
+        // partitioned as packed points, then split into arrays
+        int n = scan.size();
+        std::vector<BuildPoint> points(n);
+        for(int i=0; i<n; i++) {
+            points[i] = {{scan.x[i], scan.y[i], scan.z[i]}, i};
+        }
+        nodes.clear();
+        nodes.reserve(2 * n / scan_tree_leaf + 1);
+        if(n > 0) build(points, 0, n);
+        std::vector<int> ring_of(n);
+        for(int s=0; s<scan.rings(); s++) {
+            std::fill(ring_of.begin() + scan.begin(s),
+                    ring_of.begin() + scan.end(s), s);
+        }
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        ring.resize(n);
+        index.resize(n);
+        for(int i=0; i<n; i++) {
+            x[i] = points[i].p[0];
+            y[i] = points[i].p[1];
+            z[i] = points[i].p[2];
+            index[i] = points[i].index;
+            ring[i] = ring_of[index[i]];
+        }
+    }
+    RingNeighbors nearestOnTwoRings(const pcl::PointXYZ &p,
+            const float radius2) const {
+        // the nearest point within radius2, and the nearest within
+        // radius2 that's on a different ring, in one traversal
+        RingNeighbors nb;
+        nb.first_dist = nb.second_dist = radius2;
+        if(nodes.empty()) return nb;
+        float q[3] = {p.x, p.y, p.z}, offset[3] = {0, 0, 0};
+        search(0, q, offset, 0, nb);
+        return nb;
+    }
+    void nearestOnTwoRings(const std::vector<pcl::PointXYZ> &points,
+            const float radius2, std::vector<RingNeighbors> &neighbors) const {
+        // batch of the above, shared out over the thread pool
+        neighbors.resize(points.size());
+        thread_pool.parallelFor(0, points.size(), scan_tree_grain,
+                [&](int b, int e) {
+                for(int i=b; i<e; i++) {
+                    neighbors[i] = nearestOnTwoRings(points[i], radius2);
+                }
+                });
+    }
+    size_t bytes() const {
+        return nodes.capacity() * sizeof(Node)
+            + (x.capacity() + y.capacity() + z.capacity()) * sizeof(float)
+            + (ring.capacity() + index.capacity()) * sizeof(int);
+    }
+};
@@ -0,0 +1,226 @@
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <numeric>
+#include <list>
+#include <limits>
+#include <unordered_map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include <Eigen/StdVector>
+#include <Eigen/Dense>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/xfeatures2d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <pcl/point_types.h>
+
+#include <ceres/ceres.h>
+#include <ceres/rotation.h>
+#include <glog/logging.h>
+#include <gflags/gflags.h>
+
+#include "utility.h"
+#include "threadpool.h"
+#include "kitti.h"
+#include "costfunctions.h"
+#include "framefeatures.h"
+#include "tracks.h"
+#include "scantree.h"
+#include "velo.h"
+
+// Checks the analytic jacobians of costfunctions.h against ceres
+// autodiff of the templated operator() of the same cost, and solvePose
+// against the ceres solve it replaced. Exits nonzero on the first failure.
+
+const double jacobian_tolerance = 1e-9,
+      pose_tolerance = 1e-5, // per pose parameter
+      cost_tolerance = 1e-6; // relative
+
+std::mt19937 rng(1);
+
+double uniform(const double a) {
+    return std::uniform_real_distribution<double>(-a, a)(rng);
+}
+
+template <typename Cost, int kResidualSize>
+bool checkJacobian(const Cost &cost, const double x[6], const char *name) {
+    ceres::AutoDiffCostFunction<Cost, kResidualSize, 6> autodiff(new Cost(cost));
+    double r_auto[kResidualSize], J_auto[kResidualSize * 6],
+           r[kResidualSize], J[kResidualSize * 6];
+    const double *parameters[1] = {x};
+    double *jacobians[1] = {J_auto};
+    autodiff.Evaluate(parameters, r_auto, jacobians);
+    cost.evaluate(x, r, J);
+    for(int i=0; i<kResidualSize; i++) {
+        bool bad = !(std::abs(r[i] - r_auto[i]) <= jacobian_tolerance);
+        for(int j=0; j<6; j++) {
+            bad |= !(std::abs(J[i*6 + j] - J_auto[i*6 + j]) <= jacobian_tolerance);
+        }
+        if(bad) {
+            std::cerr << "ERROR: " << name << " residual " << i
+                << " differs from autodiff at x =";
+            for(int j=0; j<6; j++) std::cerr << " " << x[j];
+            std::cerr << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool checkJacobians() {
+    // random rotations, rotations near zero that both Rotation and
+    // ceres take to first order, and exactly zero. in between, around
+    // |w| ~ 1e-7, the closed form loses about eps / |w| to cancellation
+    // in autodiff as much as in Rotation, so it isn't a reference there
+    const double scales[] = {1, 1e-9, 0};
+    for(int t=0; t<10000; t++) {
+        double x[6];
+        double scale = scales[t % 3];
+        for(int i=0; i<3; i++) x[i] = uniform(1) * scale;
+        for(int i=3; i<6; i++) x[i] = uniform(1);
+        double m[3] = {uniform(5), uniform(2), 10 + uniform(5)},
+               n[3] = {uniform(1), uniform(1), uniform(1)},
+               s[3] = {uniform(1), uniform(1), uniform(1)},
+               tc[3] = {uniform(0.5), uniform(0.1), uniform(0.1)};
+        if(!checkJacobian<cost3D3D, 3>(
+                    cost3D3D(m[0], m[1], m[2], s[0], s[1], s[2]),
+                    x, "cost3D3D") ||
+                !checkJacobian<cost3D2D, 2>(
+                    cost3D2D(m[0], m[1], m[2], s[0], s[1], tc[0], tc[1], tc[2]),
+                    x, "cost3D2D") ||
+                !checkJacobian<cost2D3D, 2>(
+                    cost2D3D(m[0], m[1], m[2], s[0], s[1], tc[0], tc[1], tc[2]),
+                    x, "cost2D3D") ||
+                !checkJacobian<cost2D2D, 1>(
+                    cost2D2D(n[0], n[1], s[0], s[1], tc[0], tc[1], tc[2]),
+                    x, "cost2D2D") ||
+                !checkJacobian<cost3DPD, 1>(
+                    cost3DPD(m[0], m[1], m[2], n[0], n[1], n[2], s[0], s[1], s[2]),
+                    x, "cost3DPD")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void transformPoint(const double x[6], const double p[3], double q[3]) {
+    ceres::AngleAxisRotatePoint(x, p, q);
+    for(int i=0; i<3; i++) q[i] += x[3+i];
+}
+
+bool checkPoseSolvers() {
+    // solvePose and solvePoseCeres on the same residuals, one in ten
+    // a gross outlier, from a start near the true pose
+    cam_trans.clear();
+    cam_trans.push_back(Eigen::Vector3f(0, 0, 0));
+    cam_trans.push_back(Eigen::Vector3f(-0.54, 0, 0));
+    for(int t=0; t<20; t++) {
+        FrameResiduals residuals;
+        double truth[6] = {uniform(0.02), uniform(0.05), uniform(0.02),
+            uniform(0.3), uniform(0.1), 1 + uniform(0.3)};
+        for(int cam=0; cam<num_cams; cam++) {
+            double tc[3] = {cam_trans[cam](0), cam_trans[cam](1), cam_trans[cam](2)};
+            for(int i=0; i<300; i++) {
+                double m[3] = {uniform(10), uniform(2), 18 + uniform(10)}, s[3];
+                transformPoint(truth, m, s);
+                double o = rng() % 10 == 0;
+                double Ms[3] = {s[0] + tc[0], s[1] + tc[1], s[2] + tc[2]},
+                       Mm[3] = {m[0] + tc[0], m[1] + tc[1], m[2] + tc[2]};
+                residuals.batch_3D3D[cam]->push_back(cost3D3D(
+                            m[0], m[1], m[2],
+                            s[0] + uniform(0.01) + o * uniform(1), s[1] + uniform(0.01), s[2]));
+                residuals.batch_3D2D[cam]->push_back(cost3D2D(
+                            m[0], m[1], m[2],
+                            Ms[0]/Ms[2] + uniform(0.001) + o * uniform(0.1), Ms[1]/Ms[2],
+                            tc[0], tc[1], tc[2]));
+                residuals.batch_2D3D[cam]->push_back(cost2D3D(
+                            s[0], s[1], s[2],
+                            Mm[0]/Mm[2] + uniform(0.001), Mm[1]/Mm[2] + o * uniform(0.1),
+                            tc[0], tc[1], tc[2]));
+                residuals.batch_2D2D[cam]->push_back(cost2D2D(
+                            Mm[0]/Mm[2], Mm[1]/Mm[2],
+                            Ms[0]/Ms[2] + uniform(0.0005), Ms[1]/Ms[2] + uniform(0.0005),
+                            tc[0], tc[1], tc[2]));
+            }
+        }
+        for(int i=0; i<200; i++) {
+            double p[3] = {uniform(10), uniform(2), 18 + uniform(10)}, q[3];
+            transformPoint(truth, p, q);
+            Eigen::Vector3d n(uniform(1), uniform(1), uniform(1));
+            n.normalize();
+            // the plane's offset point is anywhere on the plane
+            Eigen::Vector3d along = n.unitOrthogonal();
+            residuals.batch_3DPD.push_back(cost3DPD(
+                        p[0], p[1], p[2], n[0], n[1], n[2],
+                        q[0] + along[0], q[1] + along[1], q[2] + along[2]));
+        }
+        double x[6], x_ceres[6];
+        for(int i=0; i<6; i++) {
+            x[i] = x_ceres[i] = truth[i] + uniform(i < 3 ? 0.01 : 0.1);
+        }
+
+        double lambda = pose_initial_lambda;
+        solvePose(residuals.batches(), x, lambda);
+
+        // the same problem frameToFrame builds under CERES_POSE_SOLVER
+        ceres::Problem::Options problem_options;
+        problem_options.enable_fast_removal = true;
+        problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        ceres::Problem problem(problem_options);
+        residuals.addTo(problem, x_ceres);
+        problem.AddResidualBlock(&residuals.batch_3DPD, NULL, x_ceres);
+        solvePoseCeres(problem, residuals, x_ceres);
+
+        NormalEquations ne, ne_ceres;
+        poseNormalEquations(residuals.batches(), x, ne, false);
+        poseNormalEquations(residuals.batches(), x_ceres, ne_ceres, false);
+        bool bad = !(std::abs(ne.cost - ne_ceres.cost)
+                <= cost_tolerance * std::max(ne.cost, ne_ceres.cost));
+        for(int i=0; i<6; i++) {
+            bad |= !(std::abs(x[i] - x_ceres[i]) <= pose_tolerance);
+        }
+        if(bad) {
+            std::cerr << "ERROR: solvePose and ceres disagree, costs "
+                << ne.cost << " " << ne_ceres.cost << ", poses";
+            for(int i=0; i<6; i++) std::cerr << " " << x[i] << "/" << x_ceres[i];
+            std::cerr << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if(!checkJacobians()) return 1;
+    std::cerr << "Analytic jacobians match autodiff" << std::endl;
+    if(!checkPoseSolvers()) return 1;
+    std::cerr << "solvePose matches ceres" << std::endl;
+    return 0;
+}
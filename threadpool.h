@@ -0,0 +1,178 @@
+#pragma once
+
+// Fixed pool of worker threads shared by the whole pipeline.
+// Each worker has its own deque of tasks: tasks submitted from a
+// worker go on its own deque, which it runs newest first, and an idle
+// worker steals the oldest task of another. So a task that splits into
+// more tasks keeps its subtasks local until someone else is free.
+// parallelFor hands out chunks of an index range through an atomic
+// counter and the calling thread works on chunks too, so a parallelFor
+// issued from inside another parallel region can't deadlock waiting
+// for workers that are all busy.
+class ThreadPool {
+    private:
+    struct Queue {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+    };
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Queue>> queues;
+    // pending counts queued tasks not yet claimed by a worker
+    std::mutex mutex;
+    std::condition_variable wake;
+    int pending = 0;
+    bool stopping = false;
+    std::atomic<unsigned> next_queue;
+
+    static int &workerIndex(const ThreadPool *pool) {
+        // index of the calling thread among pool's workers, or -1
+        thread_local const ThreadPool *owner = nullptr;
+        thread_local int index = -1;
+        if(owner != pool) {
+            owner = pool;
+            index = -1;
+        }
+        return index;
+    }
+    bool pop(const int self, std::function<void()> &task) {
+        // own deque from the back, then the others' from the front
+        int n = queues.size();
+        for(int k=0; k<n; k++) {
+            int q = (std::max(self, 0) + k) % n;
+            Queue &queue = *queues[q];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if(queue.tasks.empty()) continue;
+            if(q == self) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+    void work(const int self) {
+        workerIndex(this) = self;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] {
+                        return stopping || pending > 0;
+                        });
+                if(pending == 0) return;
+                pending--;
+            }
+            // the claimed task is in some deque, but another worker
+            // may take it first and leave us one pushed after our scan
+            std::function<void()> task;
+            while(!pop(self, task)) {
+                std::this_thread::yield();
+            }
+            task();
+        }
+    }
+    void enqueue(std::function<void()> task) {
+        int self = workerIndex(this);
+        int q = self >= 0 ? self : next_queue++ % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            queues[q]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending++;
+        }
+        wake.notify_one();
+    }
+
+    public:
+    ThreadPool(const int n = std::thread::hardware_concurrency()) {
+        next_queue = 0;
+        for(int i=0; i<std::max(n, 1); i++) {
+            queues.push_back(std::unique_ptr<Queue>(new Queue));
+        }
+        for(int i=0; i<std::max(n, 1); i++) {
+            workers.push_back(std::thread(&ThreadPool::work, this, i));
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto &w : workers) {
+            w.join();
+        }
+    }
+    int size() const {
+        return workers.size();
+    }
+    template <typename F>
+    std::future<typename std::result_of<F()>::type> submit(F f) {
+        typedef typename std::result_of<F()>::type R;
+        auto task = std::make_shared<std::packaged_task<R()>>(f);
+        std::future<R> result = task->get_future();
+        enqueue([task] {(*task)();});
+        return result;
+    }
+    void parallelFor(
+            const int begin,
+            const int end,
+            const int grain,
+            const std::function<void(int, int)> &f
+            ) {
+        // calls f(b, e) on consecutive chunks of [begin, end)
+        // of at most grain indices, and returns when all are done.
+        // if f throws, the remaining chunks are skipped and the first
+        // exception is rethrown here once no chunk is running any more
+        int chunks = (end - begin + grain - 1) / grain;
+        if(chunks <= 0) return;
+        if(chunks == 1) {
+            f(begin, end);
+            return;
+        }
+        struct Job {
+            std::atomic<int> next, done;
+            std::atomic<bool> failed;
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        auto job = std::make_shared<Job>();
+        job->next = 0;
+        job->done = 0;
+        job->failed = false;
+        auto run = [job, chunks, begin, end, grain, &f] {
+            int c;
+            while((c = job->next++) < chunks) {
+                if(!job->failed) {
+                    try {
+                        f(begin + c * grain, std::min(end, begin + (c + 1) * grain));
+                    } catch(...) {
+                        std::lock_guard<std::mutex> lock(job->mutex);
+                        if(!job->error) job->error = std::current_exception();
+                        job->failed = true;
+                    }
+                }
+                if(++job->done == chunks) {
+                    std::lock_guard<std::mutex> lock(job->mutex);
+                    job->finished.notify_all();
+                }
+            }
+        };
+        for(int i=0, _i = std::min(chunks - 1, size()); i<_i; i++) {
+            enqueue(run);
+        }
+        run();
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&job, chunks] {
+                return job->done == chunks;
+                });
+        if(job->error) std::rethrow_exception(job->error);
+    }
+};
+
+ThreadPool thread_pool;
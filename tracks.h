@@ -0,0 +1,136 @@
+#pragma once
+
+// One sighting of a keypoint: where cam saw it at frame,
+// either in canonical camera coordinates or, if the keypoint
+// had lidar depth, as a physical point
+struct Observation {
+    int frame, cam;
+    bool depth;
+    float x, y, z;
+
+    cv::Point2f point2() const {return cv::Point2f(x, y);}
+    pcl::PointXYZ point3() const {return pcl::PointXYZ(x, y, z);}
+};
+
+// Observations of every keypoint id, kept in fixed size chunks
+// allocated out of one arena. A track is a linked list of chunks,
+// so appending is O(1) and reading it back touches one chunk
+// per track_chunk observations. Retired tracks give their chunks
+// back for new tracks to use.
+class TrackStore {
+    private:
+    struct Chunk {
+        Observation obs[track_chunk];
+        int next;
+    };
+    struct Track {
+        int head = -1, tail = -1, prev_tail = -1, size = 0;
+    };
+    std::vector<Chunk> chunks;
+    std::vector<int> free_chunks;
+    std::vector<Track> tracks;
+
+    int newChunk() {
+        int c;
+        if(free_chunks.size()) {
+            c = free_chunks.back();
+            free_chunks.pop_back();
+        } else {
+            c = chunks.size();
+            chunks.emplace_back();
+        }
+        chunks[c].next = -1;
+        return c;
+    }
+
+    public:
+    void resize(const int n) {
+        // ids are handed out in order, so this only ever grows
+        if(n > tracks.size()) tracks.resize(n);
+    }
+    int size(const int id) const {
+        return tracks[id].size;
+    }
+    void add(const int id, const int frame, const int cam,
+            const cv::Point2f &p) {
+        Observation o = {frame, cam, false, p.x, p.y, 0};
+        add(id, o);
+    }
+    void add(const int id, const int frame, const int cam,
+            const pcl::PointXYZ &p) {
+        Observation o = {frame, cam, true, p.x, p.y, p.z};
+        add(id, o);
+    }
+    void add(const int id, const Observation &o) {
+        Track &t = tracks[id];
+        int k = t.size % track_chunk;
+        if(k == 0) {
+            int c = newChunk();
+            if(t.tail == -1) {
+                t.head = c;
+            } else {
+                chunks[t.tail].next = c;
+            }
+            t.prev_tail = t.tail;
+            t.tail = c;
+        }
+        chunks[t.tail].obs[k] = o;
+        t.size++;
+    }
+    template <typename F>
+    void forEach(const int id, F f) const {
+        // visits observations in the order they were added
+        const Track &t = tracks[id];
+        int left = t.size;
+        for(int c = t.head; c != -1; c = chunks[c].next) {
+            int n = std::min(left, track_chunk);
+            for(int k=0; k<n; k++) {
+                f(chunks[c].obs[k]);
+            }
+            left -= n;
+        }
+    }
+    template <typename F>
+    void forEachSince(const int id, const int start, F f) const {
+        // visits observations start.. in the order they were added,
+        // without walking the list if they're in the last two chunks
+        const Track &t = tracks[id];
+        if(start >= t.size) return;
+        int tail_begin = (t.size - 1) / track_chunk * track_chunk;
+        int c, k;
+        if(start >= tail_begin) {
+            c = t.tail;
+            k = start - tail_begin;
+        } else if(start >= tail_begin - track_chunk) {
+            c = t.prev_tail;
+            k = start - (tail_begin - track_chunk);
+        } else {
+            c = t.head;
+            k = start;
+            while(k >= track_chunk) {
+                c = chunks[c].next;
+                k -= track_chunk;
+            }
+        }
+        for(int i=start; i<t.size; i++) {
+            f(chunks[c].obs[k]);
+            if(++k == track_chunk) {
+                c = chunks[c].next;
+                k = 0;
+            }
+        }
+    }
+    void retire(const int id) {
+        // the keypoint won't be seen again
+        Track &t = tracks[id];
+        for(int c = t.head; c != -1; c = chunks[c].next) {
+            free_chunks.push_back(c);
+        }
+        t = Track();
+    }
+    size_t bytes() const {
+        return chunks.capacity() * sizeof(Chunk)
+            + free_chunks.capacity() * sizeof(int)
+            + tracks.capacity() * sizeof(Track);
+    }
+};
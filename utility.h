@@ -102,7 +102,7 @@ class util {
         p.z = y[2] + transform[5];
     }
 
-    static cv::Point2f geomedian(std::vector<cv::Point2f> P) {
+    static cv::Point2f geomedian(const std::vector<cv::Point2f> &P) {
         int m = P.size();
         cv::Point2f y(0,0);
         for(int i=0; i<m; i++) {
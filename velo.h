@@ -25,34 +25,55 @@ cv::Point2f canonical2pixel(
     return cv::Point2f(p(0)/p(2), p(1)/p(2));
 }
 
+void buildPyramid(
+        const cv::Mat &img,
+        std::vector<cv::Mat> &pyramid
+        ) {
+    cv::buildOpticalFlowPyramid(
+            img,
+            pyramid,
+            cv::Size(lkt_window, lkt_window),
+            lkt_pyramid);
+}
+
+// One optical flow run, from the features of cam1 at frame1
+// to the image of cam2 at frame2
+struct TrackPair {
+    int cam1, cam2, frame1, frame2;
+    const std::vector<cv::Mat> *pyramid1, *pyramid2;
+};
+
+struct TrackedFeatures {
+    std::vector<cv::Point2f> keypoints, keypoints_p;
+    std::vector<int> keypoint_ids;
+    // row of each tracked feature in the source frame
+    std::vector<int> source;
+};
+
 void trackFeatures(
-        std::vector<std::vector<std::vector<cv::Point2f>>> &keypoints,
-        std::vector<std::vector<std::vector<cv::Point2f>>> &keypoints_p,
-        std::vector<std::vector<std::vector<int>>> &keypoint_ids,
-        std::vector<std::vector<cv::Mat>> &descriptors,
-        const cv::Mat &img1,
-        const cv::Mat &img2,
-        const int cam1,
+        const std::vector<cv::Point2f> &keypoints_p1,
+        const std::vector<int> &keypoint_ids1,
+        const std::vector<cv::Mat> &pyramid1,
+        const std::vector<cv::Mat> &pyramid2,
         const int cam2,
-        const int frame1,
-        const int frame2
+        TrackedFeatures &tracked
         ) {
-    const Eigen::Matrix3f &Kinv1 = cam_intrinsic_inv[cam1];
+    // only reads its inputs, so several pairs can run at once
     const Eigen::Matrix3f &Kinv2 = cam_intrinsic_inv[cam2];
 
-    int m = keypoints[cam1][frame1].size();
+    int m = keypoints_p1.size();
     if(m == 0) {
         std::cerr << "ERROR: No features to track." << std::endl;
     }
     std::vector<cv::Point2f> points1(m), points2(m);
     for(int i=0; i<m; i++) {
-        points1[i] = keypoints_p[cam1][frame1][i];
+        points1[i] = keypoints_p1[i];
     }
     std::vector<unsigned char> status;
     std::vector<float> err;
     cv::calcOpticalFlowPyrLK(
-            img1,
-            img2,
+            pyramid1,
+            pyramid2,
             points1,
             points2,
             status,
@@ -66,9 +87,6 @@ void trackFeatures(
                 ),
             0
             );
-    int col_cells = img_width / min_distance + 2,
-        row_cells = img_height / min_distance + 2;
-    std::vector<std::vector<cv::Point2f>> occupied(col_cells * row_cells);
     for(int i=0; i<m; i++) {
         if(!status[i]) {
             continue;
@@ -82,57 +100,63 @@ void trackFeatures(
                 points2[i].y >= img_height) {
             continue;
         }
-        /*
-        int col = points2[i].x / min_distance,
-            row = points2[i].y / min_distance;
-        bool bad = false;
-        int col_start = std::max(col-1, 0),
-            col_end = std::min(col+1, col_cells-1),
-            row_start = std::max(row-1, 0),
-            row_end = std::min(row+1, row_cells-1);
-        float md2 = min_distance * min_distance;
-        for(int c=col_start; c<=col_end && !bad; c++) {
-            for(int r=row_start; r<=row_end && !bad; r++) {
-                for(auto pp : occupied[c * row_cells + r]) {
-                    if(util::dist2(pp, points2[i]) < md2) {
-                        bad = true;
-                        break;
-                    }
-                }
-            }
-        }
-        if(bad) continue;
-        occupied[col * row_cells + row].push_back(points2[i]);
-        */
-        keypoints_p[cam2][frame2].push_back(points2[i]);
-        keypoints[cam2][frame2].push_back(
+        tracked.keypoints_p.push_back(points2[i]);
+        tracked.keypoints.push_back(
                 pixel2canonical(points2[i], Kinv2)
                 );
-        keypoint_ids[cam2][frame2].push_back(
-                keypoint_ids[cam1][frame1][i]);
-        descriptors[cam2][frame2].push_back(
-                descriptors[cam1][frame1].row(i).clone());
+        tracked.keypoint_ids.push_back(keypoint_ids1[i]);
+        tracked.source.push_back(i);
+    }
+}
+
+void trackFeatures(
+        FrameStore &features,
+        const std::vector<TrackPair> &pairs
+        ) {
+    // pairs are tracked concurrently, then appended to the
+    // destination frames in the order given, as if run one by one
+    std::vector<TrackedFeatures> tracked(pairs.size());
+    thread_pool.parallelFor(0, pairs.size(), 1, [&](int b, int e) {
+            for(int p=b; p<e; p++) {
+                const TrackPair &tp = pairs[p];
+                trackFeatures(
+                        features.at(tp.cam1, tp.frame1).keypoints_p,
+                        features.at(tp.cam1, tp.frame1).ids,
+                        *tp.pyramid1,
+                        *tp.pyramid2,
+                        tp.cam2,
+                        tracked[p]);
+            }
+            });
+    for(int p=0; p<pairs.size(); p++) {
+        const TrackPair &tp = pairs[p];
+        const TrackedFeatures &t = tracked[p];
+        const FrameFeatures &f1 = features.at(tp.cam1, tp.frame1);
+        FrameFeatures &f2 = features.at(tp.cam2, tp.frame2);
+        for(int j=0; j<t.source.size(); j++) {
+            f2.push_back(
+                    t.keypoints[j],
+                    t.keypoints_p[j],
+                    t.keypoint_ids[j],
+                    f1.descriptor(t.source[j]));
+        }
     }
 }
 
 void detectFeatures(
-        std::vector<std::vector<cv::Point2f>> &keypoints,
-        std::vector<std::vector<cv::Point2f>> &keypoints_p,
-        std::vector<std::vector<int>> &keypoint_ids,
-        std::vector<cv::Mat> &descriptors,
+        FrameFeatures &features,
         const cv::Ptr<cv::FeatureDetector> detector,
         const cv::Ptr<cv::DescriptorExtractor> extractor,
         const cv::Mat &img,
         int &id_counter,
-        const int cam,
-        const int frame
+        const int cam
         ) {
     const Eigen::Matrix3f &Kinv = cam_intrinsic_inv[cam];
 
     int col_cells = img_width / min_distance + 2,
         row_cells = img_height / min_distance + 2;
     std::vector<std::vector<cv::Point2f>> occupied(col_cells * row_cells);
-    for(cv::Point2f p : keypoints_p[frame]) {
+    for(cv::Point2f p : features.keypoints_p) {
         int col = p.x / min_distance,
             row = p.y / min_distance;
         occupied[col * row_cells + row].push_back(p);
@@ -165,370 +189,709 @@ void detectFeatures(
             }
         }
         if(bad) continue;
-        keypoints_p[frame].push_back(kp.pt);
-        keypoints[frame].push_back(
-                pixel2canonical(kp.pt, Kinv)
-                );
-        descriptors[frame].push_back(tmp_descriptors.row(kp_i).clone());
-        keypoint_ids[frame].push_back(id_counter++);
+        features.push_back(
+                pixel2canonical(kp.pt, Kinv),
+                kp.pt,
+                id_counter++,
+                tmp_descriptors.ptr(kp_i));
         detected++;
     }
     //std::cerr << "Detected: " << detected << std::endl;
 }
 
 void consolidateFeatures(
-        std::vector<cv::Point2f> &keypoints,
-        std::vector<cv::Point2f> &keypoints_p,
-        std::vector<int> &keypoint_ids,
-        cv::Mat &descriptors,
+        FrameFeatures &features,
         const int cam
         ) {
     // merges keypoints of the same id using the geometric median
-    // geometric median is computed in canonical coordinates
+    // geometric median is computed in canonical coordinates.
+    // the result is sorted by id and keeps the descriptor
+    // of the first keypoint with each id
     const Eigen::Matrix3f &K = cam_intrinsic[cam];
-    int m = keypoint_ids.size();
-    std::map<int, std::vector<int>> keypoints_map;
-    for(int i=0; i<m; i++) {
-        keypoints_map[keypoint_ids[i]].push_back(i);
-    }
-    int mm = keypoints_map.size();
-    std::vector<cv::Point2f> tmp_keypoints(mm);
-    std::vector<cv::Point2f> tmp_keypoints_p(mm);
-    std::vector<int> tmp_keypoint_ids(mm);
-    cv::Mat tmp_descriptors(mm, descriptors.cols, descriptors.type());
-    int mi = 0;
-    for(auto kp : keypoints_map) {
-        int id = kp.first;
-        int n = kp.second.size();
+    const std::vector<int> &ids = features.ids;
+    int m = features.size();
+    // scratch space kept around between frames
+    thread_local std::vector<int> order;
+    thread_local std::vector<cv::Point2f> group;
+    thread_local FrameFeatures merged;
+    order.resize(m);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&ids](int a, int b) {
+            return ids[a] < ids[b] || (ids[a] == ids[b] && a < b);
+            });
+    merged.clear();
+    for(int i=0; i<m; ) {
+        int id = ids[order[i]];
+        int n = 1;
+        while(i+n < m && ids[order[i+n]] == id) n++;
 
         cv::Point2f gm_keypoint;
         if(n > 2) {
-            std::vector<cv::Point2f> tmp_tmp_keypoints(n);
-            for(int i=0; i<n; i++) {
-                int j = kp.second[i];
-                tmp_tmp_keypoints[i] = keypoints[j];
+            group.resize(n);
+            for(int j=0; j<n; j++) {
+                group[j] = features.keypoints[order[i+j]];
             }
-            gm_keypoint = util::geomedian(tmp_tmp_keypoints);
+            gm_keypoint = util::geomedian(group);
         } else if(n ==2) {
             gm_keypoint = (
-                    keypoints[kp.second[0]] + 
-                    keypoints[kp.second[1]])/2;
+                    features.keypoints[order[i]] +
+                    features.keypoints[order[i+1]])/2;
         } else {
-            gm_keypoint = keypoints[kp.second[0]];
+            gm_keypoint = features.keypoints[order[i]];
         }
-        tmp_keypoint_ids[mi] = id;
-        tmp_keypoints[mi] = gm_keypoint;
-        tmp_keypoints_p[mi] = canonical2pixel(gm_keypoint, K);
-        descriptors.row(kp.second[0]).copyTo(tmp_descriptors.row(mi));
-        mi++;
+        merged.push_back(
+                gm_keypoint,
+                canonical2pixel(gm_keypoint, K),
+                id,
+                features.descriptor(order[i]));
+        i += n;
     }
-
-    keypoints = tmp_keypoints;
-    keypoints_p = tmp_keypoints_p;
-    keypoint_ids = tmp_keypoint_ids;
-    tmp_descriptors.copyTo(descriptors);
+    features.swapFeatures(merged);
 }
 
 void removeTerribleFeatures(
-        std::vector<cv::Point2f> &keypoints,
-        std::vector<cv::Point2f> &keypoints_p,
-        std::vector<int> &keypoint_ids,
-        cv::Mat &descriptors,
+        FrameFeatures &features,
         const cv::Ptr<cv::DescriptorExtractor> extractor,
         const cv::Mat &img,
         const int cam
         ) {
     // remove features if the extracted descriptor doesn't match
+    const std::vector<cv::Point2f> &keypoints_p = features.keypoints_p;
     std::vector<cv::KeyPoint> cvKP(keypoints_p.size());
     for(int i=0; i<keypoints_p.size(); i++) {
         cvKP[i].pt = keypoints_p[i];
     }
-    std::vector<cv::Point2f> tmp_keypoints;
-    std::vector<cv::Point2f> tmp_keypoints_p;
-    std::vector<int> tmp_keypoint_ids;
-    cv::Mat tmp_descriptors, tmp_tmp_descriptors;
+    cv::Mat tmp_descriptors;
+    thread_local std::vector<char> keep;
+    keep.assign(features.size(), false);
 
     int i=0;
-    extractor->compute(img, cvKP, tmp_tmp_descriptors);
+    // compute drops keypoints it can't describe, so walk both lists
+    extractor->compute(img, cvKP, tmp_descriptors);
     for(int j=0; j<cvKP.size(); j++) {
         while(cv::norm(keypoints_p[i] - cvKP[j].pt) > kp_EPS) {
             i++;
         }
-        if(cv::norm(descriptors.row(i),
-                    tmp_tmp_descriptors.row(j),
-                    cv::NORM_HAMMING) < match_thresh) {
-            tmp_keypoints.push_back(keypoints[i]);
-            tmp_keypoints_p.push_back(keypoints_p[i]);
-            tmp_keypoint_ids.push_back(keypoint_ids[i]);
-            tmp_descriptors.push_back(descriptors.row(i).clone());
-        }
+        keep[i] = hammingDistance(
+                features.descriptor(i),
+                tmp_descriptors.ptr(j)) < match_thresh;
     }
-    keypoints = tmp_keypoints;
-    keypoints_p = tmp_keypoints_p;
-    keypoint_ids = tmp_keypoint_ids;
-    tmp_descriptors.copyTo(descriptors);
+    features.compact(keep);
 }
 
 void removeSlightlyLessTerribleFeatures(
-        std::vector<std::vector<std::vector<cv::Point2f>>> &keypoints,
-        std::vector<std::vector<std::vector<cv::Point2f>>> &keypoints_p,
-        std::vector<std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr>> &kp_with_depth,
-        std::vector<std::vector<std::vector<int>>> &keypoint_ids,
-        std::vector<std::vector<cv::Mat>> &descriptors,
-        std::vector<std::vector<std::vector<int>>> &has_depth,
+        FrameStore &features,
         const int frame,
         const std::vector<std::vector<std::pair<int, int>>> &good_matches) {
     // remove features not matched in good_matches
+    thread_local std::vector<char> keep;
     for(int cam=0; cam<num_cams; cam++) {
-        // I'm not smart enough to figure how to delete things
-        // other than making a new vector, pointcloud, or mat
-        // and then copying everything over :(
-        // In Python I could have just written a = a[indices]
-        std::set<int> good_indices;
+        FrameFeatures &f = features.at(cam, frame);
+        int n = f.size();
+        keep.assign(n, false);
         for(auto gm : good_matches[cam]) {
-            good_indices.insert(gm.first);
+            keep[gm.first] = true;
         }
-        int m = good_indices.size(), n = keypoints[cam][frame].size();
+        int m = std::count(keep.begin(), keep.end(), true);
         std::cerr << "Good matches of " << cam << ": " << m << "/" << n << std::endl;
-        std::vector<cv::Point2f> tmp_keypoints(m);
-        std::vector<cv::Point2f> tmp_keypoints_p(m);
-        pcl::PointCloud<pcl::PointXYZ>::Ptr tmp_kp_with_depth(
-                new pcl::PointCloud<pcl::PointXYZ>);
-        std::vector<int> tmp_keypoint_ids(m);
-        cv::Mat tmp_descriptors(
-                m, descriptors[cam][frame].cols,
-                descriptors[cam][frame].type());
-        std::vector<int> tmp_has_depth(m);
-        int j = 0, jd = 0;
-        for(int i=0; i<n; i++) {
-            if(!good_indices.count(i)) continue;
-            tmp_keypoints[j] = keypoints[cam][frame][i];
-            tmp_keypoints_p[j] = keypoints_p[cam][frame][i];
-            tmp_keypoint_ids[j] = keypoint_ids[cam][frame][i];
-            descriptors[cam][frame].row(i).copyTo(tmp_descriptors.row(j));
-            int d = has_depth[cam][frame][i];
-            if(d != -1) {
-                tmp_kp_with_depth->push_back(kp_with_depth[cam][frame]->at(d));
-                tmp_has_depth[j] = jd++;
-            } else {
-                tmp_has_depth[j] = -1;
-            }
-            j++;
+        f.compact(keep);
+    }
+}
+
+// Lidar points visible in one camera, ring by ring, in the same
+// layout as RingScan: ring s is at indices begin(s) .. end(s)-1.
+// u, v are canonical camera coordinates, z is the depth in the camera
+// and index points back into the RingScan the projection was made from.
+struct RingProjection {
+    std::vector<float> u, v, z;
+    std::vector<int> index;
+    std::vector<int> offsets = std::vector<int>(1, 0);
+    // column buckets over u for finding where a keypoint falls in a ring:
+    // grid[s * (grid_cols+1) + c] is the first point of ring s
+    // at or past the left edge of column c.
+    // only valid for rings whose u is sorted, see sorted[s]
+    std::vector<int> grid;
+    std::vector<char> sorted;
+    int grid_cols = 0;
+    float grid_lo = 0, grid_scale = 0;
+    int size() const {return u.size();}
+    int rings() const {return offsets.size() - 1;}
+    int begin(const int s) const {return offsets[s];}
+    int end(const int s) const {return offsets[s+1];}
+    int ringSize(const int s) const {return offsets[s+1] - offsets[s];}
+    void clear() {
+        u.clear();
+        v.clear();
+        z.clear();
+        index.clear();
+        offsets.assign(1, 0);
+        grid.clear();
+        sorted.clear();
+    }
+    int column(const float x) const {
+        int c = (x - grid_lo) * grid_scale;
+        return std::min(std::max(c, 0), grid_cols);
+    }
+    int upperBound(const int s, const float x) const {
+        // first point of sorted ring s with u > x
+        int b = begin(s), e = end(s);
+        int pos = grid[s * (grid_cols+1) + column(x)];
+        // the column is only a hint, rounding can put x next to it
+        while(pos > b && u[pos-1] > x) pos--;
+        while(pos < e && u[pos] <= x) pos++;
+        return pos;
+    }
+};
+
+void buildProjectionGrid(
+        RingProjection &projection,
+        const int cam
+        ) {
+    // roughly one column per pixel of image width
+    int cols = projection_grid_cols;
+    projection.grid_cols = cols;
+    projection.grid_lo = min_x[cam];
+    projection.grid_scale = cols / (max_x[cam] - min_x[cam]);
+    projection.grid.resize(projection.rings() * (cols+1));
+    projection.sorted.resize(projection.rings());
+    const float *u = projection.u.data();
+    for(int s=0; s<projection.rings(); s++) {
+        int b = projection.begin(s), e = projection.end(s);
+        bool sorted = true;
+        for(int i=b+1; i<e && sorted; i++) {
+            sorted = u[i-1] <= u[i];
+        }
+        projection.sorted[s] = sorted;
+        int *g = projection.grid.data() + s * (cols+1);
+        int pos = b;
+        for(int c=0; c<=cols; c++) {
+            float edge = projection.grid_lo + c / projection.grid_scale;
+            while(sorted && pos < e && u[pos] < edge) pos++;
+            g[c] = pos;
+        }
+    }
+}
+
+float floatCeil(const double d) {
+    // smallest float >= d, so that comparing a float against it
+    // gives the same answer as comparing against d in double
+    float f = d;
+    if(f < d) f = std::nextafter(f, INFINITY);
+    return f;
+}
+
+int projectRing(
+        const float *x,
+        const float *y,
+        const float *z,
+        const int first,
+        const int n,
+        const float t[3],
+        const float bounds[4],
+        float *u,
+        float *v,
+        float *depth,
+        int *index
+        ) {
+    // projects n points and writes the ones inside the camera frustum
+    // to u, v, depth, index, in order. returns how many were written.
+    // the frustum is min_x, max_x, min_y, max_y rounded with floatCeil
+    int w = 0, i = 0;
+#if defined(__AVX2__)
+    const __m256 tx = _mm256_set1_ps(t[0]),
+          ty = _mm256_set1_ps(t[1]),
+          tz = _mm256_set1_ps(t[2]),
+          lo_x = _mm256_set1_ps(bounds[0]),
+          hi_x = _mm256_set1_ps(bounds[1]),
+          lo_y = _mm256_set1_ps(bounds[2]),
+          hi_y = _mm256_set1_ps(bounds[3]),
+          zero = _mm256_setzero_ps();
+    alignas(32) float cxs[8], cys[8], pzs[8];
+    for(; i + 8 <= n; i += 8) {
+        __m256 px = _mm256_add_ps(_mm256_loadu_ps(x + i), tx),
+               py = _mm256_add_ps(_mm256_loadu_ps(y + i), ty),
+               pz = _mm256_add_ps(_mm256_loadu_ps(z + i), tz);
+        __m256 cx = _mm256_div_ps(px, pz),
+               cy = _mm256_div_ps(py, pz);
+        __m256 in = _mm256_and_ps(
+                _mm256_and_ps(
+                    _mm256_cmp_ps(pz, zero, _CMP_GT_OQ),
+                    _mm256_cmp_ps(cx, lo_x, _CMP_GE_OQ)),
+                _mm256_and_ps(
+                    _mm256_and_ps(
+                        _mm256_cmp_ps(cx, hi_x, _CMP_LT_OQ),
+                        _mm256_cmp_ps(cy, lo_y, _CMP_GE_OQ)),
+                    _mm256_cmp_ps(cy, hi_y, _CMP_LT_OQ)));
+        int mask = _mm256_movemask_ps(in);
+        if(!mask) continue;
+        _mm256_store_ps(cxs, cx);
+        _mm256_store_ps(cys, cy);
+        _mm256_store_ps(pzs, pz);
+        while(mask) {
+            int k = __builtin_ctz(mask);
+            u[w] = cxs[k];
+            v[w] = cys[k];
+            depth[w] = pzs[k];
+            index[w] = first + i + k;
+            w++;
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 tx = _mm_set1_ps(t[0]),
+          ty = _mm_set1_ps(t[1]),
+          tz = _mm_set1_ps(t[2]),
+          lo_x = _mm_set1_ps(bounds[0]),
+          hi_x = _mm_set1_ps(bounds[1]),
+          lo_y = _mm_set1_ps(bounds[2]),
+          hi_y = _mm_set1_ps(bounds[3]),
+          zero = _mm_setzero_ps();
+    alignas(16) float cxs[4], cys[4], pzs[4];
+    for(; i + 4 <= n; i += 4) {
+        __m128 px = _mm_add_ps(_mm_loadu_ps(x + i), tx),
+               py = _mm_add_ps(_mm_loadu_ps(y + i), ty),
+               pz = _mm_add_ps(_mm_loadu_ps(z + i), tz);
+        __m128 cx = _mm_div_ps(px, pz),
+               cy = _mm_div_ps(py, pz);
+        __m128 in = _mm_and_ps(
+                _mm_and_ps(
+                    _mm_cmpgt_ps(pz, zero),
+                    _mm_cmpge_ps(cx, lo_x)),
+                _mm_and_ps(
+                    _mm_and_ps(
+                        _mm_cmplt_ps(cx, hi_x),
+                        _mm_cmpge_ps(cy, lo_y)),
+                    _mm_cmplt_ps(cy, hi_y)));
+        int mask = _mm_movemask_ps(in);
+        if(!mask) continue;
+        _mm_store_ps(cxs, cx);
+        _mm_store_ps(cys, cy);
+        _mm_store_ps(pzs, pz);
+        while(mask) {
+            int k = __builtin_ctz(mask);
+            u[w] = cxs[k];
+            v[w] = cys[k];
+            depth[w] = pzs[k];
+            index[w] = first + i + k;
+            w++;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for(; i < n; i++) {
+        float px = x[i] + t[0],
+              py = y[i] + t[1],
+              pz = z[i] + t[2];
+        float cx = px/pz, cy = py/pz;
+        if(pz > 0 && cx >= bounds[0] && cx < bounds[1]
+                && cy >= bounds[2] && cy < bounds[3]) {
+            u[w] = cx;
+            v[w] = cy;
+            depth[w] = pz;
+            index[w] = first + i;
+            w++;
         }
-        // these are all allocated on the stack or smart pointers
-        // so no memory leaks, hopefully
-        keypoints[cam][frame] = tmp_keypoints;
-        keypoints_p[cam][frame] = tmp_keypoints_p;
-        kp_with_depth[cam][frame] = tmp_kp_with_depth;
-        keypoint_ids[cam][frame] = tmp_keypoint_ids;
-        tmp_descriptors.copyTo(descriptors[cam][frame]);
-        has_depth[cam][frame] = tmp_has_depth;
     }
+    return w;
 }
 
 void projectLidarToCamera(
-        const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans,
-        std::vector<std::vector<cv::Point2f>> &projection,
-        std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans_valid,
+        const RingScan &scans,
+        RingProjection &projection,
         const int cam
         ) {
 
     int bad = 0;
-    Eigen::Vector3f t = cam_trans[cam];
-
-    for(int s=0; s<scans.size(); s++) {
-        pcl::PointCloud<pcl::PointXYZ> projected_points;
-        projection.push_back(std::vector<cv::Point2f>());
-        scans_valid.push_back(pcl::PointCloud<pcl::PointXYZ>::Ptr(
-                    new pcl::PointCloud<pcl::PointXYZ>));
-        for(int i=0, _i = scans[s]->size(); i<_i; i++) {
-            pcl::PointXYZ p = scans[s]->at(i);
-            pcl::PointXYZ pp(p.x + t(0), p.y + t(1), p.z + t(2));
-            cv::Point2f c(pp.x/pp.z, pp.y/pp.z);
-            if(pp.z > 0 && c.x >= min_x[cam] && c.x < max_x[cam]
-                    && c.y >= min_y[cam] && c.y < max_y[cam]) {
-                // remove points occluded by current point
-                while(projection[s].size() > 0
-                        && c.x < projection[s].back().x
-                        && pp.z < projected_points.back().z) {
-                    projection[s].pop_back();
-                    projected_points.points.pop_back();
-                    scans_valid[s]->points.pop_back();
-                    bad++;
-                }
-                // ignore occluded points
-                if(projection[s].size() > 0
-                        && c.x < projection[s].back().x
-                        && pp.z > projected_points.back().z) {
-                    bad++;
-                    continue;
-                }
-                projection[s].push_back(c);
-                projected_points.push_back(pp);
-                scans_valid[s]->push_back(scans[s]->at(i));
+    const float t[3] = {cam_trans[cam](0), cam_trans[cam](1), cam_trans[cam](2)};
+    const float bounds[4] = {
+        floatCeil(min_x[cam]), floatCeil(max_x[cam]),
+        floatCeil(min_y[cam]), floatCeil(max_y[cam])};
+
+    // sized for the worst case and trimmed at the end,
+    // so reusing a projection doesn't allocate
+    int n = scans.size();
+    projection.u.resize(n);
+    projection.v.resize(n);
+    projection.z.resize(n);
+    projection.index.resize(n);
+    projection.offsets.assign(1, 0);
+    float *u = projection.u.data(), *v = projection.v.data(),
+          *z = projection.z.data();
+    int *index = projection.index.data();
+    int w = 0;
+    for(int s=0; s<scans.rings(); s++) {
+        int ring_start = w, b = scans.begin(s);
+        int culled = projectRing(
+                scans.x.data() + b,
+                scans.y.data() + b,
+                scans.z.data() + b,
+                b,
+                scans.ringSize(s),
+                t,
+                bounds,
+                u + ring_start,
+                v + ring_start,
+                z + ring_start,
+                index + ring_start);
+        // occlusion pass over the culled points, compacting in place;
+        // the write position never passes the read position
+        for(int r = ring_start; r < ring_start + culled; r++) {
+            float cx = u[r], cy = v[r], pz = z[r];
+            int i = index[r];
+            // remove points occluded by current point
+            while(w > ring_start
+                    && cx < u[w-1]
+                    && pz < z[w-1]) {
+                w--;
+                bad++;
+            }
+            // ignore occluded points
+            if(w > ring_start
+                    && cx < u[w-1]
+                    && pz > z[w-1]) {
+                bad++;
+                continue;
             }
+            u[w] = cx;
+            v[w] = cy;
+            z[w] = pz;
+            index[w] = i;
+            w++;
         }
-        //std::cerr << s << " " << scans_valid[s]->size()
-        //    << " " << scans_valid[s]->points.size() << std::endl;
+        projection.offsets.push_back(w);
     }
+    projection.u.resize(w);
+    projection.v.resize(w);
+    projection.z.resize(w);
+    projection.index.resize(w);
+    buildProjectionGrid(projection, cam);
     //std::cerr << "Lidar projection bad: " << bad << std::endl;
 }
 
-std::vector<int> featureDepthAssociation(
-        const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans,
-        const std::vector<std::vector<cv::Point2f>> &projection,
-        const std::vector<cv::Point2f> &keypoints,
-        pcl::PointCloud<pcl::PointXYZ>::Ptr keypoints_with_depth,
-        std::vector<int> &has_depth
+bool depthAtKeypoint(
+        const RingScan &scans,
+        const RingProjection &projection,
+        const cv::Point2f &kp,
+        pcl::PointXYZ &kpwd
         ) {
-    has_depth.resize(keypoints.size());
-    for(int i=0; i<has_depth.size(); i++) {
-        has_depth[i] = -1;
-    }
-    /*
-    std::cerr << "Sizes: " <<  scans.size() << " "
-        << projection.size() << " "
-        << keypoints.size() << std::endl;
-        */
-    int has_depth_n = 0;
-    for(int k=0; k<keypoints.size(); k++) {
-        has_depth[k] = -1;
-        cv::Point2f kp = keypoints[k];
-        int last_interp = -1;
-        for(int s=0, _s = scans.size(); s<_s; s++) {
-            bool found = false;
-            if(projection[s].size() <= 1) {
-                last_interp = -1;
-                continue;
+    // index into projection of the bracketing point on the previous ring
+    int last_interp = -1;
+    const float *u = projection.u.data(), *v = projection.v.data();
+    for(int s=0, _s = scans.rings(); s<_s; s++) {
+        bool found = false;
+        if(projection.ringSize(s) <= 1) {
+            last_interp = -1;
+            continue;
+        }
+        const int b = projection.begin(s), e = projection.end(s);
+        // find m such that u[m] <= kp.x < u[m+1]
+        int m = -1;
+        if(projection.sorted[s]) {
+            int pos = projection.upperBound(s, kp.x);
+            if(pos > b && pos < e) {
+                found = true;
+                m = pos - 1;
             }
-            int lo = 0, hi = projection[s].size() - 2, mid = 0;
+        } else {
+            // occlusion removal can leave ties out of order,
+            // so fall back to the search we've always done
+            int lo = 0, hi = projection.ringSize(s) - 2, mid = 0;
             while(lo <= hi) {
                 mid = (lo + hi)/2;
-                if(projection[s][mid].x > kp.x) {
+                if(u[b + mid] > kp.x) {
                     hi = mid-1;
-                } else if(projection[s][mid+1].x <= kp.x) {
+                } else if(u[b + mid + 1] <= kp.x) {
                     lo = mid+1;
                 } else {
                     found = true;
-                    if(last_interp != -1
-                            && (projection[s][mid].y > kp.y) !=
-                                (projection[s-1][last_interp].y > kp.y)
-                            && abs(projection[s][mid].x -
-                                projection[s][mid+1].x)
-                                < depth_assoc_thresh
-                            && abs(projection[s-1][last_interp].x -
-                                projection[s-1][last_interp+1].x)
-                                < depth_assoc_thresh
-                            ) {
-                        /*
-                         * Perform linear interpolation using four points:
-                         * s-1, last_interp ----- interp2 ----- s, last_interp+1
-                         *                           |
-                         *                           kp
-                         *                           |
-                         *      s, mid ---------- interp1 --------- s, mid+1
-                         */
-                        /*
-                        std::cerr << "depth association: " << kp
-                            << " " << projection[s][mid]
-                            << " " << projection[s][mid+1]
-                            << " " << projection[s-1][last_interp]
-                            << " " << projection[s-1][last_interp+1]
-                            << std::endl;
-                        std::cerr << "                   "
-                            << " " << scans[s]->at(mid)
-                            << " " << scans[s]->at(mid+1)
-                            << " " << scans[s-1]->at(last_interp)
-                            << " " << scans[s-1]->at(last_interp+1)
-                            << " ";
-                            */
-                        pcl::PointXYZ interp1 = util::linterpolate(
-                                scans[s]->at(mid),
-                                scans[s]->at(mid+1),
-                                projection[s][mid].x,
-                                projection[s][mid+1].x,
-                                kp.x);
-                        pcl::PointXYZ interp2 = util::linterpolate(
-                                scans[s-1]->at(last_interp),
-                                scans[s-1]->at(last_interp+1),
-                                projection[s-1][last_interp].x,
-                                projection[s-1][last_interp+1].x,
-                                kp.x);
-                        float i1y = util::linterpolate(
-                                projection[s][mid].y,
-                                projection[s][mid+1].y,
-                                projection[s][mid].x,
-                                projection[s][mid+1].x,
-                                kp.x);
-                        float i2y = util::linterpolate(
-                                projection[s-1][last_interp].y,
-                                projection[s-1][last_interp+1].y,
-                                projection[s-1][last_interp].x,
-                                projection[s-1][last_interp+1].x,
-                                kp.x);
-
-                        pcl::PointXYZ kpwd = util::linterpolate(
-                                interp1,
-                                interp2,
-                                i1y,
-                                i2y,
-                                kp.y);
-
-                        //std::cerr << kpwd << std::endl;
-
-                        keypoints_with_depth->push_back(kpwd);
-                        has_depth[k] = has_depth_n;
-                        has_depth_n++;
-                    }
-                    last_interp = mid;
+                    m = b + mid;
                     break;
                 }
             }
-            if(!found) {
-                last_interp = -1;
+        }
+        if(!found) {
+            last_interp = -1;
+            continue;
+        }
+        int l = last_interp;
+        if(last_interp != -1
+                && (v[m] > kp.y) != (v[l] > kp.y)
+                && abs(u[m] - u[m+1]) < depth_assoc_thresh
+                && abs(u[l] - u[l+1]) < depth_assoc_thresh
+                ) {
+            /*
+             * Perform linear interpolation using four points:
+             * s-1, last_interp ----- interp2 ----- s, last_interp+1
+             *                           |
+             *                           kp
+             *                           |
+             *      s, mid ---------- interp1 --------- s, mid+1
+             */
+            pcl::PointXYZ interp1 = util::linterpolate(
+                    scans.point(projection.index[m]),
+                    scans.point(projection.index[m+1]),
+                    u[m],
+                    u[m+1],
+                    kp.x);
+            pcl::PointXYZ interp2 = util::linterpolate(
+                    scans.point(projection.index[l]),
+                    scans.point(projection.index[l+1]),
+                    u[l],
+                    u[l+1],
+                    kp.x);
+            float i1y = util::linterpolate(
+                    v[m],
+                    v[m+1],
+                    u[m],
+                    u[m+1],
+                    kp.x);
+            float i2y = util::linterpolate(
+                    v[l],
+                    v[l+1],
+                    u[l],
+                    u[l+1],
+                    kp.x);
+
+            kpwd = util::linterpolate(
+                    interp1,
+                    interp2,
+                    i1y,
+                    i2y,
+                    kp.y);
+            return true;
+        }
+        last_interp = m;
+    }
+    return false;
+}
+
+void featureDepthAssociation(
+        const RingScan &scans,
+        const RingProjection &projection,
+        FrameFeatures &features
+        ) {
+    const std::vector<cv::Point2f> &keypoints = features.keypoints;
+    std::vector<int> &has_depth = features.has_depth;
+    int n = keypoints.size();
+    has_depth.resize(n);
+    features.kp_with_depth->clear();
+    /*
+    std::cerr << "Sizes: " <<  scans.rings() << " "
+        << projection.size() << " "
+        << keypoints.size() << std::endl;
+        */
+    // keypoints are independent, but kp_with_depth has to come out
+    // in keypoint order, so interpolate in parallel and number after
+    // the workers see their own thread_locals, so take a reference
+    thread_local std::vector<pcl::PointXYZ> kpwd_scratch;
+    std::vector<pcl::PointXYZ> &kpwd = kpwd_scratch;
+    kpwd.resize(n);
+    thread_pool.parallelFor(0, n, depth_assoc_grain, [&](int b, int e) {
+            for(int k=b; k<e; k++) {
+                has_depth[k] = depthAtKeypoint(
+                        scans, projection, keypoints[k], kpwd[k]);
             }
-            if(has_depth[k] != -1) break;
+            });
+    int has_depth_n = 0;
+    for(int k=0; k<n; k++) {
+        if(has_depth[k]) {
+            features.kp_with_depth->push_back(kpwd[k]);
+            has_depth[k] = has_depth_n++;
+        } else {
+            has_depth[k] = -1;
         }
     }
     /*
     std::cerr << "Has depth: " << has_depth_n << "/" << keypoints.size() << std::endl;
     */
-    return has_depth;
+}
+
+struct HammingMatch {
+    // nearest and second nearest train descriptors,
+    // -1 and no_match if there aren't that many
+    int train, train2;
+    int distance, distance2;
+    static const int no_match = descriptor_bytes * 8 + 1;
+};
+
+void hammingMatch(
+        const FrameFeatures &query,
+        const FrameFeatures &train,
+        std::vector<HammingMatch> &matches
+        ) {
+    // brute force, two nearest train descriptors for every query.
+    // query rows are split among threads, and each chunk runs over
+    // the train set one tile at a time so the tile stays in cache
+    int nq = query.size(), nt = train.size();
+    matches.resize(nq);
+    thread_pool.parallelFor(0, nq, match_grain, [&](int b, int e) {
+            for(int q=b; q<e; q++) {
+                matches[q] = {-1, -1,
+                    HammingMatch::no_match, HammingMatch::no_match};
+            }
+            for(int t0=0; t0<nt; t0+=match_tile) {
+                int t1 = std::min(nt, t0 + match_tile);
+                for(int q=b; q<e; q++) {
+                    const unsigned char *qd = query.descriptor(q);
+                    HammingMatch &m = matches[q];
+                    for(int t=t0; t<t1; t++) {
+                        int d = hammingDistance(qd, train.descriptor(t));
+                        if(d < m.distance) {
+                            m.train2 = m.train;
+                            m.distance2 = m.distance;
+                            m.train = t;
+                            m.distance = d;
+                        } else if(d < m.distance2) {
+                            m.train2 = t;
+                            m.distance2 = d;
+                        }
+                    }
+                }
+            }
+            });
+}
+
+void guidedMatch(
+        const FrameFeatures &query,
+        const FrameFeatures &train,
+        const double transform[6],
+        const int cam,
+        std::vector<HammingMatch> &matches
+        ) {
+    // like hammingMatch, but only query keypoints with depth are
+    // matched, and only against train keypoints near where transform
+    // puts them in the train image. the rest get no match
+    const Eigen::Matrix3f &K = cam_intrinsic[cam];
+    Eigen::Matrix4d T = util::pose_mat2vec(transform);
+    const float r = guided_match_radius, r2 = r * r;
+    int cols = img_width / r + 1, rows = img_height / r + 1;
+    // train keypoints bucketed by pixel, cells of radius size,
+    // so every candidate is in the 3x3 cells around the prediction
+    thread_local std::vector<int> starts_scratch, fill, items_scratch;
+    // the workers see their own thread_locals, so take references
+    std::vector<int> &starts = starts_scratch, &items = items_scratch;
+    auto cellOf = [&](const cv::Point2f &p) {
+        int c = std::min(std::max(int(p.x / r), 0), cols - 1),
+            w = std::min(std::max(int(p.y / r), 0), rows - 1);
+        return c * rows + w;
+    };
+    starts.assign(cols * rows + 1, 0);
+    items.resize(train.size());
+    for(int t=0; t<train.size(); t++) {
+        starts[cellOf(train.keypoints_p[t]) + 1]++;
+    }
+    for(int c=0; c<cols * rows; c++) {
+        starts[c+1] += starts[c];
+    }
+    fill = starts;
+    for(int t=0; t<train.size(); t++) {
+        items[fill[cellOf(train.keypoints_p[t])]++] = t;
+    }
+
+    int nq = query.size();
+    matches.resize(nq);
+    bool depth = query.has_depth.size() == nq;
+    thread_pool.parallelFor(0, nq, match_grain, [&](int b, int e) {
+            std::vector<int> candidates;
+            for(int q=b; q<e; q++) {
+                HammingMatch &m = matches[q];
+                m = {-1, -1, HammingMatch::no_match, HammingMatch::no_match};
+                if(!depth || query.has_depth[q] == -1) continue;
+                const pcl::PointXYZ &p =
+                    query.kp_with_depth->points[query.has_depth[q]];
+                Eigen::Vector4d x = T * Eigen::Vector4d(p.x, p.y, p.z, 1);
+                Eigen::Vector3f c = x.head<3>().cast<float>() + cam_trans[cam];
+                if(c(2) <= 0) continue;
+                cv::Point2f pp = canonical2pixel(
+                        cv::Point2f(c(0)/c(2), c(1)/c(2)), K);
+                if(pp.x < -r || pp.y < -r ||
+                        pp.x > img_width + r || pp.y > img_height + r) {
+                    continue;
+                }
+                int col = cellOf(pp) / rows,
+                    row = cellOf(pp) % rows;
+                candidates.clear();
+                for(int cc = std::max(col-1, 0); cc <= std::min(col+1, cols-1); cc++) {
+                    for(int rr = std::max(row-1, 0); rr <= std::min(row+1, rows-1); rr++) {
+                        int cell = cc * rows + rr;
+                        for(int k = starts[cell]; k < starts[cell+1]; k++) {
+                            int t = items[k];
+                            if(util::dist2(pp, train.keypoints_p[t]) <= r2) {
+                                candidates.push_back(t);
+                            }
+                        }
+                    }
+                }
+                // same tie breaking as hammingMatch
+                std::sort(candidates.begin(), candidates.end());
+                const unsigned char *qd = query.descriptor(q);
+                for(int t : candidates) {
+                    int d = hammingDistance(qd, train.descriptor(t));
+                    if(d < m.distance) {
+                        m.train2 = m.train;
+                        m.distance2 = m.distance;
+                        m.train = t;
+                        m.distance = d;
+                    } else if(d < m.distance2) {
+                        m.train2 = t;
+                        m.distance2 = d;
+                    }
+                }
+            }
+            });
 }
 
 void matchFeatures(
-        const std::vector<std::vector<cv::Mat>> &descriptors,
+        const FrameStore &features,
         const int cam1,
         const int cam2,
         const int frame1,
         const int frame2,
-        std::vector<std::pair<int, int>> &matches
+        std::vector<std::pair<int, int>> &matches,
+        const double *transform = NULL
         ) {
+    // given the predicted transform from frame1 to frame2,
+    // only keypoints near their predicted positions are compared
     double start = clock()/double(CLOCKS_PER_SEC);
     /*
     std::cerr << "Matching: ";
-    std::cerr << descriptors[cam1].size()
-        << ", " << descriptors[cam2].size()
-        << ", " << frame1 << " " << frame2 << "; ";
-    std::cerr << descriptors[cam1][frame1].size()
-        << ", " << descriptors[cam2][frame2].size();
+    std::cerr << frame1 << " " << frame2 << "; ";
+    std::cerr << features.at(cam1, frame1).size()
+        << ", " << features.at(cam2, frame2).size();
         */
+    const FrameFeatures &query = features.at(cam1, frame1),
+          &train = features.at(cam2, frame2);
     std::vector<cv::DMatch> mc;
+    thread_local std::vector<HammingMatch> hm;
+    if(transform) {
+        guidedMatch(query, train, transform, cam2, hm);
+        for(int q=0; q<hm.size(); q++) {
+            if(hm[q].train == -1) continue;
+            mc.push_back(cv::DMatch(q, hm[q].train, hm[q].distance));
+        }
+    }
+    if(mc.size() < guided_min_matches) {
+        // too little to go on, so compare everything after all
+        mc.clear();
 #ifdef USE_CUDA
-    cv::Ptr<cv::cuda::DescriptorMatcher> d_matcher =
-        cv::cuda::DescriptorMatcher::createBFMatcher(cv::NORM_HAMMING);
-    cv::cuda::GpuMat d_query(descriptors[cam1][frame1]);
-    cv::cuda::GpuMat d_train(descriptors[cam2][frame2]);
-    cv::cuda::GpuMat d_matches;
-    d_matcher->matchAsync(d_query, d_train, d_matches);
-
-    d_matcher->matchConvert(d_matches, mc);
+        // creating the matcher is not free, so each thread keeps one
+        thread_local cv::Ptr<cv::cuda::DescriptorMatcher> d_matcher =
+            cv::cuda::DescriptorMatcher::createBFMatcher(cv::NORM_HAMMING);
+        cv::cuda::GpuMat d_query(query.descriptors());
+        cv::cuda::GpuMat d_train(train.descriptors());
+        cv::cuda::GpuMat d_matches;
+        d_matcher->matchAsync(d_query, d_train, d_matches);
+
+        d_matcher->matchConvert(d_matches, mc);
 #else
-    cv::BFMatcher matcher(cv::NORM_HAMMING);
-    matcher.match(
-            descriptors[cam1][frame1],
-            descriptors[cam2][frame2], mc);
+        hammingMatch(query, train, hm);
+        mc.reserve(hm.size());
+        for(int q=0; q<hm.size(); q++) {
+            if(hm[q].train == -1) continue;
+            mc.push_back(cv::DMatch(q, hm[q].train, hm[q].distance));
+        }
 #endif
+    }
 
     double end = clock()/double(CLOCKS_PER_SEC);
     //std::cerr << "; " << end-start << std::endl;
@@ -549,62 +912,537 @@ void matchFeatures(
     }
 }
 void matchFeatures(
-        const std::vector<std::vector<cv::Mat>> &descriptors,
+        const FrameStore &features,
         const int frame1,
         const int frame2,
-        std::vector<std::vector<std::pair<int, int>>> &matches
+        std::vector<std::vector<std::pair<int, int>>> &matches,
+        const double *transform = NULL
         ) {
     for(int cam=0; cam<num_cams; cam++) {
-        matchFeatures(descriptors, cam, cam, frame1, frame2, matches[cam]);
+        matchFeatures(features, cam, cam, frame1, frame2, matches[cam],
+                transform);
     }
 }
 
 void matchUsingId(
-        const std::vector<std::vector<std::vector<int>>> &keypoint_ids,
+        const std::vector<int> &ids1,
+        const std::vector<int> &ids2,
+        std::vector<std::pair<int, int>> &matches
+        ) {
+    // pairs up equal ids, in the order of ids2.
+    // consolidated features are sorted by id, so this is usually
+    // a merge; otherwise ids1 goes into a hash table kept between calls
+    if(std::is_sorted(ids1.begin(), ids1.end()) &&
+            std::is_sorted(ids2.begin(), ids2.end())) {
+        int i = 0, n = ids1.size();
+        for(int ind = 0; ind < ids2.size(); ind++) {
+            int id = ids2[ind];
+            while(i < n && ids1[i] < id) i++;
+            // the last of equal ids wins, as with a map
+            while(i+1 < n && ids1[i+1] == id) i++;
+            if(i < n && ids1[i] == id) {
+                matches.push_back(std::make_pair(i, ind));
+            }
+        }
+        return;
+    }
+    thread_local std::vector<std::pair<int, int>> table;
+    int size = 16;
+    while(size < 2 * ids1.size()) size *= 2;
+    table.assign(size, std::make_pair(-1, -1));
+    for(int ind = 0; ind < ids1.size(); ind++) {
+        int id = ids1[ind];
+        int h = (id * 2654435761u) & (size-1);
+        while(table[h].first != -1 && table[h].first != id) {
+            h = (h+1) & (size-1);
+        }
+        table[h] = std::make_pair(id, ind);
+    }
+    for(int ind = 0; ind < ids2.size(); ind++) {
+        int id = ids2[ind];
+        int h = (id * 2654435761u) & (size-1);
+        while(table[h].first != -1 && table[h].first != id) {
+            h = (h+1) & (size-1);
+        }
+        if(table[h].first == id) {
+            matches.push_back(std::make_pair(table[h].second, ind));
+        }
+    }
+}
+void matchUsingId(
+        const FrameStore &features,
         const int cam1,
         const int cam2,
         const int frame1,
         const int frame2,
         std::vector<std::pair<int, int>> &matches
         ) {
-    std::map<int, int> id2ind;
-    for(int ind = 0; ind < keypoint_ids[cam1][frame1].size(); ind++) {
-        int id = keypoint_ids[cam1][frame1][ind];
-        id2ind[id] = ind;
-    }
-    for(int ind = 0; ind < keypoint_ids[cam2][frame2].size(); ind++) {
-        int id = keypoint_ids[cam2][frame2][ind];
-        if(id2ind.count(id))
-            matches.push_back(std::make_pair(id2ind[id], ind));
-    }
+    matchUsingId(
+            features.at(cam1, frame1).ids,
+            features.at(cam2, frame2).ids,
+            matches);
 }
 void matchUsingId(
-        const std::vector<std::vector<std::vector<int>>> &keypoint_ids,
+        const FrameStore &features,
         const int frame1,
         const int frame2,
         std::vector<std::vector<std::pair<int, int>>> &matches
         ) {
     for(int cam=0; cam<num_cams; cam++) {
-        matchUsingId(keypoint_ids, cam, cam, frame1, frame2, matches[cam]);
+        matches[cam].reserve(matches[cam].size() +
+                std::min(features.at(cam, frame1).size(),
+                    features.at(cam, frame2).size()));
+        matchUsingId(features, cam, cam, frame1, frame2, matches[cam]);
     }
 }
 
+struct FrameResiduals {
+    // frameToFrame's residuals, one batched cost function per residual
+    // type per camera plus one for point set registration
+    FrameResiduals() :
+        batch_3DPD(RobustLoss(RobustLoss::CAUCHY, loss_thresh_3DPD, weight_3DPD)) {
+        for(int cam=0; cam<num_cams; cam++) {
+            batch_3D3D.emplace_back(new BatchedCostFunction<cost3D3D, 3>(
+                        RobustLoss(RobustLoss::ARCTAN, loss_thresh_3D3D)));
+            batch_2D2D.emplace_back(new BatchedCostFunction<cost2D2D, 1>(
+                        RobustLoss(RobustLoss::ARCTAN, loss_thresh_2D2D, weight_2D2D)));
+            batch_3D2D.emplace_back(new BatchedCostFunction<cost3D2D, 2>(
+                        RobustLoss(RobustLoss::ARCTAN, loss_thresh_3D2D, weight_3D2D)));
+            batch_2D3D.emplace_back(new BatchedCostFunction<cost2D3D, 2>(
+                        RobustLoss(RobustLoss::ARCTAN, loss_thresh_3D2D, weight_3D2D)));
+        }
+    }
+    void clear() {
+        for(int cam=0; cam<num_cams; cam++) {
+            batch_3D3D[cam]->clear();
+            batch_2D2D[cam]->clear();
+            batch_3D2D[cam]->clear();
+            batch_2D3D[cam]->clear();
+        }
+        batch_3DPD.clear();
+    }
+    // adds the non-empty visual batches to problem, the point set
+    // registration batch changes size so it's added separately
+    void addTo(ceres::Problem &problem, double transform[6]) {
+        std::vector<ceres::CostFunction*> batches;
+        for(int cam=0; cam<num_cams; cam++) {
+            batches.push_back(batch_3D3D[cam].get());
+            batches.push_back(batch_2D2D[cam].get());
+            batches.push_back(batch_3D2D[cam].get());
+            batches.push_back(batch_2D3D[cam].get());
+        }
+        for(auto b : batches) {
+            if(b->num_residuals() > 0) {
+                problem.AddResidualBlock(b, NULL, transform);
+            }
+        }
+    }
+    // whether the i-th residual of that type and camera is unmasked
+    bool active(const int cam, const ResidualType type, const int i) const {
+        switch(type) {
+            case RESIDUAL_3D3D:
+                return batch_3D3D[cam]->active[i];
+            case RESIDUAL_3D2D:
+                return batch_3D2D[cam]->active[i];
+            case RESIDUAL_2D3D:
+                return batch_2D3D[cam]->active[i];
+            case RESIDUAL_2D2D:
+                return batch_2D2D[cam]->active[i];
+        }
+        return false;
+    }
+    std::vector<const PoseBatch*> batches() const {
+        std::vector<const PoseBatch*> batches;
+        for(int cam=0; cam<num_cams; cam++) {
+            batches.push_back(batch_3D3D[cam].get());
+            batches.push_back(batch_2D2D[cam].get());
+            batches.push_back(batch_3D2D[cam].get());
+            batches.push_back(batch_2D3D[cam].get());
+        }
+        batches.push_back(&batch_3DPD);
+        return batches;
+    }
+    std::vector<std::unique_ptr<BatchedCostFunction<cost3D3D, 3>>> batch_3D3D;
+    std::vector<std::unique_ptr<BatchedCostFunction<cost2D2D, 1>>> batch_2D2D;
+    std::vector<std::unique_ptr<BatchedCostFunction<cost3D2D, 2>>> batch_3D2D;
+    std::vector<std::unique_ptr<BatchedCostFunction<cost2D3D, 2>>> batch_2D3D;
+    BatchedCostFunction<cost3DPD, 1> batch_3DPD;
+};
+
 void residualStats(
-        ceres::Problem &problem,
+        const FrameResiduals &residuals,
+        const double transform[6],
         const std::vector<std::vector<std::pair<int, int>>> &good_matches,
         const std::vector<std::vector<ResidualType>> &residual_type
         );
 
+DEFINE_int32(solver_max_iterations, 50, "max iterations of every solve");
+DEFINE_double(solver_function_tolerance, 1e-6, "relative decrease in cost to stop at");
+#ifdef CERES_POSE_SOLVER
+// only the ceres pose solve has a linear solver to pick
+DEFINE_int32(solver_threads, 0, "threads for ceres evaluation, 0 for one per core");
+DEFINE_string(linear_solver, "DENSE_SCHUR", "ceres linear solver, e.g. DENSE_QR, DENSE_NORMAL_CHOLESKY, DENSE_SCHUR");
+DEFINE_bool(benchmark_linear_solvers, false, "time every ceres pose solve with each dense linear solver");
+#endif
+
+ceres::Solver::Options solverOptions() {
+    // solver configuration from the command line, shared by every solve
+    ceres::Solver::Options options;
+    options.linear_solver_type = ceres::DENSE_SCHUR;
+    options.num_threads = thread_pool.size();
+#ifdef CERES_POSE_SOLVER
+    if(!ceres::StringToLinearSolverType(FLAGS_linear_solver, &options.linear_solver_type)) {
+        std::cerr << "ERROR: unknown linear solver " << FLAGS_linear_solver << std::endl;
+        options.linear_solver_type = ceres::DENSE_SCHUR;
+    }
+    if(FLAGS_solver_threads > 0) options.num_threads = FLAGS_solver_threads;
+#endif
+    options.max_num_iterations = FLAGS_solver_max_iterations;
+    options.function_tolerance = FLAGS_solver_function_tolerance;
+    options.minimizer_progress_to_stdout = false;
+    return options;
+}
+
+void poseNormalEquations(
+        const std::vector<const PoseBatch*> &batches,
+        const double x[6],
+        NormalEquations &ne,
+        const bool jacobians
+        ) {
+    // residuals are split into chunks of pose_grain across all batches,
+    // each chunk accumulates on its own and the chunks are summed in
+    // order, so the result doesn't depend on scheduling
+    struct Chunk {
+        const PoseBatch *batch;
+        int begin, end;
+    };
+    std::vector<Chunk> chunks;
+    for(auto b : batches) {
+        for(int i=0; i<b->size(); i+=pose_grain) {
+            chunks.push_back({b, i, std::min(b->size(), i + pose_grain)});
+        }
+    }
+    std::vector<NormalEquations,
+        Eigen::aligned_allocator<NormalEquations>> partial(chunks.size());
+    thread_pool.parallelFor(0, chunks.size(), 1, [&](int b, int e) {
+            for(int c=b; c<e; c++) {
+                chunks[c].batch->accumulate(x,
+                        chunks[c].begin, chunks[c].end, partial[c], jacobians);
+            }
+            });
+    ne.setZero();
+    for(auto &p : partial) {
+        ne += p;
+    }
+}
+
+void solvePose(
+        const std::vector<const PoseBatch*> &batches,
+        double transform[6],
+        double &lambda
+        ) {
+    // Levenberg-Marquardt on the 6 pose parameters with IRLS weights,
+    // the normal equations are only 6x6 so they're solved directly.
+    // damping and stopping rules follow ceres' defaults. lambda is
+    // the damping to start from and is left at where it ended, so
+    // consecutive solves of the same problem are warm started
+    typedef Eigen::Matrix<double, 6, 1> Vector6d;
+    NormalEquations ne, ne_new;
+    poseNormalEquations(batches, transform, ne, true);
+    if(!std::isfinite(ne.cost)) {
+        std::cerr << "ERROR: pose cost is not finite" << std::endl;
+        return;
+    }
+    double nu = 2;
+    for(int iter = 0; iter < FLAGS_solver_max_iterations; iter++) {
+        if(ne.g.lpNorm<Eigen::Infinity>() <= 1e-10) break;
+        Eigen::Matrix<double, 6, 6> A = ne.H;
+        A.diagonal() += lambda * ne.H.diagonal().cwiseMax(1e-6);
+        Vector6d delta = A.ldlt().solve(-ne.g);
+        Eigen::Map<Vector6d> x(transform);
+        if(delta.norm() <= pose_parameter_tolerance * (x.norm() + pose_parameter_tolerance)) break;
+        double x_new[6];
+        for(int i=0; i<6; i++) {
+            x_new[i] = transform[i] + delta[i];
+        }
+        poseNormalEquations(batches, x_new, ne_new, true);
+        double predicted = -(delta.dot(ne.g) + 0.5 * delta.dot(ne.H * delta)),
+               rho = (ne.cost - ne_new.cost) / predicted;
+        if(std::isfinite(ne_new.cost) && predicted > 0 && rho > 1e-3) {
+            double decrease = ne.cost - ne_new.cost;
+            std::copy(x_new, x_new + 6, transform);
+            std::swap(ne, ne_new);
+            lambda *= std::max(1.0/3, 1 - std::pow(2*rho - 1, 3));
+            nu = 2;
+            if(decrease <= FLAGS_solver_function_tolerance * (ne.cost + decrease)) break;
+        } else {
+            lambda *= nu;
+            nu *= 2;
+        }
+    }
+}
+
+#ifdef CERES_POSE_SOLVER
+void benchmarkLinearSolvers(
+        ceres::Problem &problem,
+        const FrameResiduals &residuals,
+        double transform[6]
+        ) {
+    // solves the pose from the same start with each dense linear
+    // solver and with solvePose, and prints the running mean time and
+    // final cost of each every 100 calls. transform is left untouched
+    static const std::vector<std::string> solvers = {
+        "DENSE_QR", "DENSE_NORMAL_CHOLESKY", "DENSE_SCHUR", "solvePose"};
+    static std::vector<double> seconds(solvers.size(), 0), costs(solvers.size(), 0);
+    static int calls = 0;
+    // concurrent registrations share the running totals
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    double start[6];
+    std::copy(transform, transform + 6, start);
+    for(int i=0; i<solvers.size(); i++) {
+        std::copy(start, start + 6, transform);
+        if(solvers[i] == "solvePose") {
+            double lambda = pose_initial_lambda;
+            auto t0 = std::chrono::steady_clock::now();
+            solvePose(residuals.batches(), transform, lambda);
+            seconds[i] += std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - t0).count();
+            NormalEquations ne;
+            poseNormalEquations(residuals.batches(), transform, ne, false);
+            costs[i] += ne.cost;
+            continue;
+        }
+        ceres::Solver::Options options = solverOptions();
+        ceres::StringToLinearSolverType(solvers[i], &options.linear_solver_type);
+        ceres::Solver::Summary summary;
+        ceres::Solve(options, &problem, &summary);
+        seconds[i] += summary.total_time_in_seconds;
+        costs[i] += summary.final_cost;
+    }
+    std::copy(start, start + 6, transform);
+    if(++calls % 100) return;
+    for(int i=0; i<solvers.size(); i++) {
+        std::cerr << "Pose solver " << solvers[i]
+            << ": " << 1000 * seconds[i] / calls << " ms"
+            << " final cost " << costs[i] / calls << std::endl;
+    }
+}
+#endif
+
+void solvePoseCeres(
+        ceres::Problem &problem,
+        const FrameResiduals &residuals,
+        double transform[6]
+        ) {
+    // reference for solvePose
+#ifdef CERES_POSE_SOLVER
+    if(FLAGS_benchmark_linear_solvers) {
+        benchmarkLinearSolvers(problem, residuals, transform);
+    }
+#endif
+    ceres::Solver::Options options = solverOptions();
+    ceres::Solver::Summary summary;
+    ceres::Solve(options, &problem, &summary);
+}
+
+struct PoseCorrespondences {
+    // frameToFrame's residuals with depth in frame1 as plain arrays,
+    // so scoring a pose hypothesis is straight-line arithmetic that
+    // the compiler can vectorize. 3D3D pairs m -> s, and 3D2D pairs
+    // m -> (s_x, s_y) seen from a camera offset by t
+    PoseCorrespondences(const FrameResiduals &residuals) {
+        for(int cam=0; cam<num_cams; cam++) {
+            const auto &b3 = *residuals.batch_3D3D[cam];
+            for(int i=0; i<b3.size(); i++) {
+                if(!b3.active[i]) continue;
+                const cost3D3D &c = b3.costs[i];
+                m3_x.push_back(c.m_x); m3_y.push_back(c.m_y); m3_z.push_back(c.m_z);
+                s3_x.push_back(c.s_x); s3_y.push_back(c.s_y); s3_z.push_back(c.s_z);
+            }
+            const auto &b2 = *residuals.batch_3D2D[cam];
+            for(int i=0; i<b2.size(); i++) {
+                if(!b2.active[i]) continue;
+                const cost3D2D &c = b2.costs[i];
+                m2_x.push_back(c.m_x); m2_y.push_back(c.m_y); m2_z.push_back(c.m_z);
+                s2_x.push_back(c.s_x); s2_y.push_back(c.s_y);
+                t2_x.push_back(c.t_x); t2_y.push_back(c.t_y); t2_z.push_back(c.t_z);
+                cam2.push_back(cam);
+            }
+        }
+    }
+    int size3D3D() const {
+        return m3_x.size();
+    }
+    int size3D2D() const {
+        return m2_x.size();
+    }
+    int score3D3D(const double *R, const double *t, const int b, const int e) const {
+        double th2 = loss_thresh_3D3D*ransac_thresh * loss_thresh_3D3D*ransac_thresh;
+        int inliers = 0;
+        for(int i=b; i<e; i++) {
+            double dx = R[0]*m3_x[i] + R[3]*m3_y[i] + R[6]*m3_z[i] + t[0] - s3_x[i],
+                   dy = R[1]*m3_x[i] + R[4]*m3_y[i] + R[7]*m3_z[i] + t[1] - s3_y[i],
+                   dz = R[2]*m3_x[i] + R[5]*m3_y[i] + R[8]*m3_z[i] + t[2] - s3_z[i];
+            inliers += dx*dx + dy*dy + dz*dz < th2;
+        }
+        return inliers;
+    }
+    int score3D2D(const double *R, const double *t, const int b, const int e) const {
+        // same residual as cost3D2D, and in front of the camera
+        double th2 = loss_thresh_3D2D*ransac_thresh * loss_thresh_3D2D*ransac_thresh;
+        int inliers = 0;
+        for(int i=b; i<e; i++) {
+            double Mx = R[0]*m2_x[i] + R[3]*m2_y[i] + R[6]*m2_z[i] + t[0] + t2_x[i],
+                   My = R[1]*m2_x[i] + R[4]*m2_y[i] + R[7]*m2_z[i] + t[1] + t2_y[i],
+                   Mz = R[2]*m2_x[i] + R[5]*m2_y[i] + R[8]*m2_z[i] + t[2] + t2_z[i],
+                   rx = Mx - s2_x[i] * Mz,
+                   ry = My - s2_y[i] * Mz;
+            inliers += (rx*rx + ry*ry < th2) & (Mz > 0);
+        }
+        return inliers;
+    }
+    int score(const double transform[6], const int best) const {
+        // inliers of the pose, scored a block at a time and given up on
+        // as soon as it can't beat best even if everything left agrees
+        double R[9];
+        ceres::AngleAxisToRotationMatrix(transform, R);
+        int n3 = size3D3D(), n2 = size3D2D(),
+            inliers = 0, left = n3 + n2;
+        for(int b=0; b<n3; b+=ransac_block) {
+            int e = std::min(n3, b + ransac_block);
+            inliers += score3D3D(R, transform + 3, b, e);
+            left -= e - b;
+            if(inliers + left <= best) return inliers;
+        }
+        for(int b=0; b<n2; b+=ransac_block) {
+            int e = std::min(n2, b + ransac_block);
+            inliers += score3D2D(R, transform + 3, b, e);
+            left -= e - b;
+            if(inliers + left <= best) return inliers;
+        }
+        return inliers;
+    }
+    std::vector<double> m3_x, m3_y, m3_z, s3_x, s3_y, s3_z;
+    std::vector<double> m2_x, m2_y, m2_z, s2_x, s2_y, t2_x, t2_y, t2_z;
+    std::vector<int> cam2;
+};
+
+void umeyamaHypothesis(
+        const PoseCorrespondences &pc,
+        const int sample[3],
+        std::vector<std::array<double, 6>> &hypotheses
+        ) {
+    // pose aligning three 3D3D pairs
+    Eigen::Matrix3d src, dst;
+    for(int k=0; k<3; k++) {
+        int i = sample[k];
+        src.col(k) << pc.m3_x[i], pc.m3_y[i], pc.m3_z[i];
+        dst.col(k) << pc.s3_x[i], pc.s3_y[i], pc.s3_z[i];
+    }
+    Eigen::Matrix4d T = Eigen::umeyama(src, dst, false);
+    if(!T.allFinite()) return;
+    std::array<double, 6> h;
+    util::pose_vec2mat(T, h.data());
+    hypotheses.push_back(h);
+}
+
+void p3pHypotheses(
+        const PoseCorrespondences &pc,
+        const int sample[3],
+        std::vector<std::array<double, 6>> &hypotheses
+        ) {
+    // up to four poses putting three 3D2D points of one camera on
+    // their rays, in canonical coordinates so the intrinsics are I
+    std::vector<cv::Point3f> object;
+    std::vector<cv::Point2f> image;
+    for(int k=0; k<3; k++) {
+        int i = sample[k];
+        object.push_back(cv::Point3f(pc.m2_x[i], pc.m2_y[i], pc.m2_z[i]));
+        image.push_back(cv::Point2f(pc.s2_x[i], pc.s2_y[i]));
+    }
+    std::vector<cv::Mat> rvecs, tvecs;
+    int n = cv::solveP3P(object, image, cv::Mat::eye(3, 3, CV_64F), cv::Mat(),
+            rvecs, tvecs, cv::SOLVEPNP_P3P);
+    int i = sample[0];
+    for(int j=0; j<n; j++) {
+        // the camera sees R m + t + t_cam
+        std::array<double, 6> h = {
+            rvecs[j].at<double>(0, 0),
+            rvecs[j].at<double>(1, 0),
+            rvecs[j].at<double>(2, 0),
+            tvecs[j].at<double>(0, 0) - pc.t2_x[i],
+            tvecs[j].at<double>(1, 0) - pc.t2_y[i],
+            tvecs[j].at<double>(2, 0) - pc.t2_z[i]};
+        hypotheses.push_back(h);
+    }
+}
+
+int ransacPose(
+        const FrameResiduals &residuals,
+        double transform[6],
+        const int seed
+        ) {
+    // RANSAC over the correspondences with depth in frame1, drawing
+    // minimal samples for Umeyama on 3D3D pairs and P3P on 3D2D pairs
+    // of one camera in turn. the predicted transform is the first
+    // hypothesis, and it's only replaced by one with more inliers.
+    // iterations stop once ransac_confidence of having drawn an
+    // all-inlier sample is reached. returns the best inlier count
+    PoseCorrespondences pc(residuals);
+    int n3 = pc.size3D3D(), n2 = pc.size3D2D();
+    std::vector<std::vector<int>> by_cam(num_cams);
+    for(int i=0; i<n2; i++) {
+        by_cam[pc.cam2[i]].push_back(i);
+    }
+    std::vector<int> cams;
+    for(int cam=0; cam<num_cams; cam++) {
+        if(by_cam[cam].size() >= 3) cams.push_back(cam);
+    }
+    int best = pc.score(transform, -1);
+    if(n3 < 3 && cams.empty()) return best;
+
+    std::mt19937 rng(seed);
+    std::vector<std::array<double, 6>> hypotheses;
+    int iterations = ransac_iterations;
+    for(int iter = 0; iter < iterations; iter++) {
+        hypotheses.clear();
+        int sample[3];
+        if(n3 >= 3 && (cams.empty() || iter % 2 == 0)) {
+            do {
+                for(int k=0; k<3; k++) sample[k] = rng() % n3;
+            } while(sample[0] == sample[1] || sample[1] == sample[2]
+                    || sample[0] == sample[2]);
+            umeyamaHypothesis(pc, sample, hypotheses);
+        } else {
+            const std::vector<int> &c = by_cam[cams[rng() % cams.size()]];
+            do {
+                for(int k=0; k<3; k++) sample[k] = c[rng() % c.size()];
+            } while(sample[0] == sample[1] || sample[1] == sample[2]
+                    || sample[0] == sample[2]);
+            p3pHypotheses(pc, sample, hypotheses);
+        }
+        for(const auto &h : hypotheses) {
+            int inliers = pc.score(h.data(), best);
+            if(inliers <= best) continue;
+            best = inliers;
+            std::copy(h.begin(), h.end(), transform);
+            double w = double(best) / (n3 + n2),
+                   needed = std::log(1 - ransac_confidence) / std::log(1 - w*w*w);
+            // clamp before the cast, needed is huge or inf while w is small
+            iterations = std::ceil(std::min(needed, double(ransac_iterations)));
+        }
+    }
+    return best;
+}
+
 Eigen::Matrix4d frameToFrame(
         const std::vector<std::vector<std::pair<int, int>>> &matches,
-        const std::vector<std::vector<std::vector<cv::Point2f>>> &keypoints,
-        const std::vector<std::vector<std::vector<int>>> &keypoint_ids,
+        const FrameStore &features,
         const std::map<int, pcl::PointXYZ> &landmarks_at_frame,
-        const std::vector<std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr>> &keypoints_with_depth,
-        const std::vector<std::vector<std::vector<int>>> &has_depth,
-        const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans_M,
-        const std::vector<pcl::PointCloud<pcl::PointXYZ>::Ptr> &scans_S,
-        const std::vector<pcl::KdTreeFLANN<pcl::PointXYZ>> &kd_trees,
+        const RingScan &scans_M,
+        const RingScan &scans_S,
+        const ScanTree &tree_S,
         const int frame1,
         const int frame2,
         double transform[6],
@@ -613,300 +1451,263 @@ Eigen::Matrix4d frameToFrame(
         const bool enable_icp
         ) {
 
-    for(int iter = 1; iter <= f2f_iterations; iter++) {
-        ceres::Problem::Options problem_options;
-        problem_options.enable_fast_removal = true;
-        ceres::Problem problem(problem_options);
+    // correspondences are built once, later iterations only mask
+    // the outliers in place and warm start from the previous solve
+    FrameResiduals residuals;
 
-        // Visual odometry
-        for(int cam = 0; cam<num_cams; cam++) {
-            //std::cerr << "Matches: " << matches[cam].size() << std::endl;
-            good_matches[cam].clear();
-            residual_type[cam].clear();
-            const std::vector<std::pair<int, int>> &mc = matches[cam];
-            for(int i=0; i<mc.size(); i++) {
-                int point1 = mc[i].first,
-                    point2 = mc[i].second;
-                int id = keypoint_ids[cam][frame2][point2];
-                bool d1 = has_depth[cam][frame1][point1] != -1,
-                     d2 = has_depth[cam][frame2][point2] != -1;
-                pcl::PointXYZ point3_2, point3_1;
-                if(landmarks_at_frame.count(id)) {
-                    point3_2 = landmarks_at_frame.at(id);
-                    /*
-                    if(d2) {
-                        std::cerr << "Using landmark "
-                            << id << ": " << point3_2 
-                            << " " << keypoints_with_depth[cam][frame2]
-                            ->at(has_depth[cam][frame2][point2]) << std::endl;
-                    }
-                    */
-                    d2 = true;
-                } else if(d2) {
-                    point3_2 = keypoints_with_depth[cam][frame2]
-                        ->at(has_depth[cam][frame2][point2]);
-                }
-                if(d1) {
-                    point3_1 = keypoints_with_depth[cam][frame1]
-                        ->at(has_depth[cam][frame1][point1]);
-                }
-                cv::Point2f point2_1 = keypoints[cam][frame1][point1];
-                cv::Point2f point2_2 = keypoints[cam][frame2][point2];
-                //std::cerr << "has depth: " << has_depth[cam][frame1].size();
-
-                //std::cerr << " " << has_depth[cam][frame1][point1]
-                //    << " " << keypoints_with_depth[cam][frame1]->size();
-                //std::cerr << " " << has_depth[cam][frame2][point2]
-                //    << " " << keypoints_with_depth[cam][frame2]->size();
-                //std::cerr << std::endl;
-                if(d1 && d2) {
-                    // 3D 3D
-                    cost3D3D *cost = new cost3D3D(
-                            point3_1.x,
-                            point3_1.y,
-                            point3_1.z,
-                            point3_2.x,
-                            point3_2.y,
-                            point3_2.z
-                            );
-                    double residual_test[3];
-                    (*cost)(transform, residual_test);
-                    if(iter > 1 &&
-                            residual_test[0] * residual_test[0] +
-                            residual_test[1] * residual_test[1] +
-                            residual_test[2] * residual_test[2]
-                            >
-                            loss_thresh_3D3D*outlier_reject/iter *
-                            loss_thresh_3D3D*outlier_reject/iter) {
-                        continue;
-                    }
-                    ceres::CostFunction* cost_function =
-                        new ceres::AutoDiffCostFunction<cost3D3D,3,6>(
-                                cost);
-                    problem.AddResidualBlock(
-                            cost_function,
-                            new ceres::ArctanLoss(loss_thresh_3D3D),
-                            transform);
-
-                    residual_type[cam].push_back(RESIDUAL_3D3D);
-                    good_matches[cam].push_back(std::make_pair(point1, point2));
+    // Visual odometry
+    for(int cam = 0; cam<num_cams; cam++) {
+        //std::cerr << "Matches: " << matches[cam].size() << std::endl;
+        good_matches[cam].clear();
+        residual_type[cam].clear();
+        const std::vector<std::pair<int, int>> &mc = matches[cam];
+        const FrameFeatures &f1 = features.at(cam, frame1),
+              &f2 = features.at(cam, frame2);
+        for(int i=0; i<mc.size(); i++) {
+            int point1 = mc[i].first,
+                point2 = mc[i].second;
+            int id = f2.ids[point2];
+            bool d1 = f1.has_depth[point1] != -1,
+                 d2 = f2.has_depth[point2] != -1;
+            pcl::PointXYZ point3_2, point3_1;
+            if(landmarks_at_frame.count(id)) {
+                point3_2 = landmarks_at_frame.at(id);
+                /*
+                if(d2) {
+                    std::cerr << "Using landmark "
+                        << id << ": " << point3_2 
+                        << " " << f2.kp_with_depth
+                        ->at(f2.has_depth[point2]) << std::endl;
                 }
-                if(!d1 && !d2) {
-                    // 2D 2D
+                */
+                d2 = true;
+            } else if(d2) {
+                point3_2 = f2.kp_with_depth->at(f2.has_depth[point2]);
+            }
+            if(d1) {
+                point3_1 = f1.kp_with_depth->at(f1.has_depth[point1]);
+            }
+            cv::Point2f point2_1 = f1.keypoints[point1];
+            cv::Point2f point2_2 = f2.keypoints[point2];
+            //std::cerr << "has depth: " << f1.has_depth.size();
+
+            //std::cerr << " " << f1.has_depth[point1]
+            //    << " " << f1.kp_with_depth->size();
+            //std::cerr << " " << f2.has_depth[point2]
+            //    << " " << f2.kp_with_depth->size();
+            //std::cerr << std::endl;
+            if(d1 && d2) {
+                // 3D 3D
+                cost3D3D cost(
+                        point3_1.x,
+                        point3_1.y,
+                        point3_1.z,
+                        point3_2.x,
+                        point3_2.y,
+                        point3_2.z
+                        );
+                residuals.batch_3D3D[cam]->push_back(cost);
+
+                residual_type[cam].push_back(RESIDUAL_3D3D);
+                good_matches[cam].push_back(std::make_pair(point1, point2));
+            }
+            if(!d1 && !d2) {
+                // 2D 2D
 #ifdef ENABLE_2D2D
-                    cost2D2D *cost =
-                        new cost2D2D(
-                                point2_1.x,
-                                point2_1.y,
-                                point2_2.x,
-                                point2_2.y,
-                                cam_trans[cam](0),
-                                cam_trans[cam](1),
-                                cam_trans[cam](2)
-                                );
-                    double residual_test[1];
-                    (*cost)(transform, residual_test);
-                    if(iter > 1 && abs(residual_test[0]) > loss_thresh_2D2D*outlier_reject/iter) continue;
-                    ceres::CostFunction* cost_function =
-                        new ceres::AutoDiffCostFunction<cost2D2D,1,6>(cost);
-                    problem.AddResidualBlock(
-                            cost_function,
-                            new ceres::ScaledLoss(
-                                new ceres::ArctanLoss(loss_thresh_2D2D),
-                                weight_2D2D,
-                                ceres::TAKE_OWNERSHIP),
-                            transform);
-                    residual_type[cam].push_back(RESIDUAL_2D2D);
-                    good_matches[cam].push_back(std::make_pair(point1, point2));
+                cost2D2D cost(
+                        point2_1.x,
+                        point2_1.y,
+                        point2_2.x,
+                        point2_2.y,
+                        cam_trans[cam](0),
+                        cam_trans[cam](1),
+                        cam_trans[cam](2)
+                        );
+                residuals.batch_2D2D[cam]->push_back(cost);
+                residual_type[cam].push_back(RESIDUAL_2D2D);
+                good_matches[cam].push_back(std::make_pair(point1, point2));
 #endif
-                }
+            }
 #ifdef ENABLE_3D2D
-                if(d1) {
-                    // 3D 2D
-                    cost3D2D *cost =
-                        new cost3D2D(
-                                point3_1.x,
-                                point3_1.y,
-                                point3_1.z,
-                                point2_2.x,
-                                point2_2.y,
-                                cam_trans[cam](0),
-                                cam_trans[cam](1),
-                                cam_trans[cam](2)
-                                );
-                    double residual_test[2];
-                    (*cost)(transform, residual_test);
-                    if(iter > 1 && residual_test[0] * residual_test[0] +
-                            residual_test[1] * residual_test[1]
-                            > loss_thresh_3D2D*outlier_reject/iter
-                            * loss_thresh_3D2D*outlier_reject/iter) continue;
-
-                    ceres::CostFunction* cost_function =
-                        new ceres::AutoDiffCostFunction<cost3D2D,2,6>(cost);
-                    problem.AddResidualBlock(
-                            cost_function,
-                            new ceres::ScaledLoss(
-                                new ceres::ArctanLoss(loss_thresh_3D2D),
-                                weight_3D2D,
-                                ceres::TAKE_OWNERSHIP),
-                            transform);
-
-                    residual_type[cam].push_back(RESIDUAL_3D2D);
-                    good_matches[cam].push_back(std::make_pair(point1, point2));
-                }
-                if(d2) {
-                    // 2D 3D
-                    cost2D3D *cost =
-                        new cost2D3D(
-                                point3_2.x,
-                                point3_2.y,
-                                point3_2.z,
-                                point2_1.x,
-                                point2_1.y,
-                                cam_trans[cam](0),
-                                cam_trans[cam](1),
-                                cam_trans[cam](2)
-                                );
-                    double residual_test[2];
-                    (*cost)(transform, residual_test);
-                    if(iter > 1 && residual_test[0] * residual_test[0] +
-                            residual_test[1] * residual_test[1]
-                            > loss_thresh_3D2D*outlier_reject/iter
-                            * loss_thresh_3D2D*outlier_reject/iter) continue;
-
-                    ceres::CostFunction* cost_function =
-                        new ceres::AutoDiffCostFunction<cost2D3D,2,6>(cost);
-                    problem.AddResidualBlock(
-                            cost_function,
-                            new ceres::ScaledLoss(
-                                new ceres::ArctanLoss(loss_thresh_3D2D),
-                                weight_3D2D,
-                                ceres::TAKE_OWNERSHIP),
-                            transform);
-
-                    residual_type[cam].push_back(RESIDUAL_2D3D);
-                    good_matches[cam].push_back(std::make_pair(point1, point2));
-                }
+            if(d1) {
+                // 3D 2D
+                cost3D2D cost(
+                        point3_1.x,
+                        point3_1.y,
+                        point3_1.z,
+                        point2_2.x,
+                        point2_2.y,
+                        cam_trans[cam](0),
+                        cam_trans[cam](1),
+                        cam_trans[cam](2)
+                        );
+                residuals.batch_3D2D[cam]->push_back(cost);
+
+                residual_type[cam].push_back(RESIDUAL_3D2D);
+                good_matches[cam].push_back(std::make_pair(point1, point2));
+            }
+            if(d2) {
+                // 2D 3D
+                cost2D3D cost(
+                        point3_2.x,
+                        point3_2.y,
+                        point3_2.z,
+                        point2_1.x,
+                        point2_1.y,
+                        cam_trans[cam](0),
+                        cam_trans[cam](1),
+                        cam_trans[cam](2)
+                        );
+                residuals.batch_2D3D[cam]->push_back(cost);
+
+                residual_type[cam].push_back(RESIDUAL_2D3D);
+                good_matches[cam].push_back(std::make_pair(point1, point2));
+            }
 #endif
+        }
+    }
+
+    std::vector<std::vector<std::pair<int, int>>> all_matches = good_matches;
+    std::vector<std::vector<ResidualType>> all_types = residual_type;
+#ifdef CERES_POSE_SOLVER
+    ceres::Problem::Options problem_options;
+    problem_options.enable_fast_removal = true;
+    problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    ceres::Problem problem(problem_options);
+    residuals.addTo(problem, transform);
+    ceres::ResidualBlockId icp_block = NULL;
+#endif
+    double lambda = pose_initial_lambda;
+    auto gate = [&](double reject) {
+        // masks residuals over reject loss thresholds at transform
+        for(int cam = 0; cam<num_cams; cam++) {
+            residuals.batch_3D3D[cam]->gate(transform, loss_thresh_3D3D*reject);
+            residuals.batch_2D2D[cam]->gate(transform, loss_thresh_2D2D*reject);
+            residuals.batch_3D2D[cam]->gate(transform, loss_thresh_3D2D*reject);
+            residuals.batch_2D3D[cam]->gate(transform, loss_thresh_3D2D*reject);
+            // keep the matches of residuals that are still active
+            int count[4] = {0, 0, 0, 0};
+            good_matches[cam].clear();
+            residual_type[cam].clear();
+            for(int i=0; i<all_types[cam].size(); i++) {
+                ResidualType type = all_types[cam][i];
+                if(residuals.active(cam, type, count[type]++)) {
+                    good_matches[cam].push_back(all_matches[cam][i]);
+                    residual_type[cam].push_back(type);
+                }
             }
         }
+    };
+    // start from the RANSAC pose and its inliers, if there are enough
+    if(ransacPose(residuals, transform, frame1) >= ransac_min_inliers) {
+        gate(ransac_thresh);
+    }
+
+    for(int iter = 1; iter <= f2f_iterations; iter++) {
+        if(iter > 1) {
+            gate(outlier_reject/iter);
+        }
 
         // Point set registration
 #ifdef ENABLE_ICP
-        std::vector<ceres::ResidualBlockId> icp_blocks;
-
-        //std::cerr << "M: " << scans_M.size() << " S: " << scans_S.size() << kd_trees.size() << std::endl;
+        //std::cerr << "M: " << scans_M.size() << " S: " << scans_S.size() << std::endl;
 
         for(int icp_iter = 0; icp_iter < icp_iterations; icp_iter++) {
-            while(icp_blocks.size() > 0) {
-                auto bid = icp_blocks.back();
-                icp_blocks.pop_back();
-                problem.RemoveResidualBlock(bid);
+#ifdef CERES_POSE_SOLVER
+            if(icp_block) {
+                problem.RemoveResidualBlock(icp_block);
+                icp_block = NULL;
             }
-            for(int sm = 0; sm < scans_M.size() * enable_icp; sm++) {
-                for(int smi = 0; smi < scans_M[sm]->size(); smi+= icp_skip) {
-                    pcl::PointXYZ pointM = scans_M[sm]->at(smi);
-                    pcl::PointXYZ pointM_untransformed = pointM;
+#endif
+            residuals.batch_3DPD.clear();
+            // every sampled point of M is looked up at once
+            std::vector<int> samples;
+            std::vector<pcl::PointXYZ> samples_M;
+            for(int sm = 0; sm < scans_M.rings() * enable_icp; sm++) {
+                for(int smi = scans_M.begin(sm); smi < scans_M.end(sm); smi+= icp_skip) {
+                    pcl::PointXYZ pointM = scans_M.point(smi);
                     util::transform_point(pointM, transform);
-                    /*
-                     * Point-to-plane ICP where plane is defined by
-                     * three Nearest Points (np):
-                     *            np_i     np_k
-                     * np_s_i ..... * ..... * .....
-                     *               \     /
-                     *                \   /
-                     *                 \ /
-                     * np_s_j ......... * .......
-                     *                 np_j
-                     */
-                    int np_i = 0, np_j = 0, np_k = 0;
-                    int np_s_i = -1, np_s_j = -1;
-                    double np_dist_i = INF, np_dist_j = INF;
-                    for(int ss = 0; ss < kd_trees.size(); ss++) {
-                        std::vector<int> id(1);
-                        std::vector<float> dist2(1);
-                        if(kd_trees[ss].nearestKSearch(pointM, 1, id, dist2) <= 0 ||
-                                dist2[0] > correspondence_thresh_icp/iter/iter/iter/iter) {
-                            continue;
-                        }
-                        pcl::PointXYZ np = scans_S[ss]->at(id[0]);
-
-                        util::subtract_assign(np, pointM);
-                        double d = util::norm2(np);
-                        if(d < np_dist_i) {
-                            np_dist_j = np_dist_i;
-                            np_j = np_i;
-                            np_s_j = np_s_i;
-                            np_dist_i = d;
-                            np_i = id[0];
-                            np_s_i = ss;
-                        } else if(d < np_dist_j) {
-                            np_dist_j = d;
-                            np_j = id[0];
-                            np_s_j = ss;
-                        }
-                    }
-                    if(np_s_i == -1 || np_s_j == -1) {
-                        continue;
-                    }
-                    int np_k_n = scans_S[np_s_i]->size(),
-                        np_k_1p = (np_i+1) % np_k_n,
-                        np_k_2p = (np_i-1 + np_k_n) % np_k_n;
-                    pcl::PointXYZ np_k_1 = scans_S[np_s_i]->at(np_k_1p),
-                        np_k_2 = scans_S[np_s_i]->at(np_k_2p);
-                    util::subtract_assign(np_k_1, pointM);
-                    util::subtract_assign(np_k_2, pointM);
-                    if(util::norm2(np_k_1) < util::norm2(np_k_2)) {
-                        np_k = np_k_1p;
-                    } else {
-                        np_k = np_k_2p;
-                    }
-                    pcl::PointXYZ s0, s1, s2;
-                    s0 = scans_S[np_s_i]->at(np_i);
-                    s1 = scans_S[np_s_j]->at(np_j);
-                    s2 = scans_S[np_s_i]->at(np_k);
-                    Eigen::Vector3f
-                        v0 = s0.getVector3fMap(),
-                           v1 = s1.getVector3fMap(),
-                           v2 = s2.getVector3fMap();
-                    Eigen::Vector3f N = (v1 - v0).cross(v2 - v0);
-                    if(N.norm() < icp_norm_condition) continue;
-                    N /= N.norm();
-                    ceres::CostFunction* cost_function =
-                        new ceres::AutoDiffCostFunction<cost3DPD, 1, 6>(
-                                new cost3DPD(
-                                    pointM_untransformed.x,
-                                    pointM_untransformed.y,
-                                    pointM_untransformed.z,
-                                    N[0], N[1], N[2],
-                                    v0[0], v0[1], v0[2]
-                                    )
-                                );
-                    auto bid = problem.AddResidualBlock(
-                            cost_function,
-                            new ceres::ScaledLoss(
-                                new ceres::CauchyLoss(loss_thresh_3DPD),
-                                weight_3DPD,
-                                ceres::TAKE_OWNERSHIP),
-                            transform);
-                    icp_blocks.push_back(bid);
+                    samples.push_back(smi);
+                    samples_M.push_back(pointM);
+                }
+            }
+            std::vector<RingNeighbors> neighbors;
+            tree_S.nearestOnTwoRings(samples_M,
+                    correspondence_thresh_icp/iter/iter/iter/iter, neighbors);
+            for(int k = 0; k < samples.size(); k++) {
+                pcl::PointXYZ pointM = samples_M[k];
+                pcl::PointXYZ pointM_untransformed = scans_M.point(samples[k]);
+                /*
+                 * Point-to-plane ICP where plane is defined by
+                 * three Nearest Points (np):
+                 *            np_i     np_k
+                 * np_s_i ..... * ..... * .....
+                 *               \     /
+                 *                \   /
+                 *                 \ /
+                 * np_s_j ......... * .......
+                 *                 np_j
+                 */
+                const RingNeighbors &nb = neighbors[k];
+                if(nb.first == -1 || nb.second == -1) {
+                    continue;
+                }
+                int np_i = nb.first, np_j = nb.second, np_k = 0;
+                int np_s_i = nb.first_ring;
+                int np_k_b = scans_S.begin(np_s_i),
+                    np_k_n = scans_S.ringSize(np_s_i),
+                    np_k_1p = np_k_b + (np_i-np_k_b+1) % np_k_n,
+                    np_k_2p = np_k_b + (np_i-np_k_b-1 + np_k_n) % np_k_n;
+                pcl::PointXYZ np_k_1 = scans_S.point(np_k_1p),
+                    np_k_2 = scans_S.point(np_k_2p);
+                util::subtract_assign(np_k_1, pointM);
+                util::subtract_assign(np_k_2, pointM);
+                if(util::norm2(np_k_1) < util::norm2(np_k_2)) {
+                    np_k = np_k_1p;
+                } else {
+                    np_k = np_k_2p;
                 }
+                pcl::PointXYZ s0, s1, s2;
+                s0 = scans_S.point(np_i);
+                s1 = scans_S.point(np_j);
+                s2 = scans_S.point(np_k);
+                Eigen::Vector3f
+                    v0 = s0.getVector3fMap(),
+                       v1 = s1.getVector3fMap(),
+                       v2 = s2.getVector3fMap();
+                Eigen::Vector3f N = (v1 - v0).cross(v2 - v0);
+                if(N.norm() < icp_norm_condition) continue;
+                N /= N.norm();
+                residuals.batch_3DPD.push_back(cost3DPD(
+                            pointM_untransformed.x,
+                            pointM_untransformed.y,
+                            pointM_untransformed.z,
+                            N[0], N[1], N[2],
+                            v0[0], v0[1], v0[2]
+                            ));
             }
+#ifdef CERES_POSE_SOLVER
+            if(residuals.batch_3DPD.size() > 0) {
+                icp_block = problem.AddResidualBlock(
+                        &residuals.batch_3DPD,
+                        NULL,
+                        transform);
+            }
+#endif
+#endif
+            //residualStats(residuals, transform, good_matches, residual_type);
+#ifdef CERES_POSE_SOLVER
+            solvePoseCeres(problem, residuals, transform);
+#else
+            solvePose(residuals.batches(), transform, lambda);
 #endif
-            //residualStats(problem, good_matches, residual_type);
-            ceres::Solver::Options options;
-            options.linear_solver_type = ceres::DENSE_SCHUR;
-            options.minimizer_progress_to_stdout = false;
-            //options.num_threads = 8;
-            ceres::Solver::Summary summary;
-            ceres::Solve(options, &problem, &summary);
             if(f2f_iterations - iter == 0) {
-                //residualStats(problem, good_matches, residual_type);
+                //residualStats(residuals, transform, good_matches, residual_type);
             }
 #ifdef ENABLE_ICP
         }
 #endif
-        residualStats(problem, good_matches, residual_type);
+        residualStats(residuals, transform, good_matches, residual_type);
     }
 
     /*
@@ -919,61 +1720,31 @@ Eigen::Matrix4d frameToFrame(
 }
 
 void residualStats(
-        ceres::Problem &problem,
+        const FrameResiduals &residuals,
+        const double transform[6],
         const std::vector<std::vector<std::pair<int, int>>> &good_matches,
         const std::vector<std::vector<ResidualType>> &residual_type
         ) {
     // compute some statistics about residuals
-    double cost;
-    std::vector<double> residuals;
-    ceres::Problem::EvaluateOptions evaluate_options;
-    evaluate_options.apply_loss_function = false;
-    problem.Evaluate(evaluate_options, &cost, &residuals, NULL, NULL);
     std::vector<double> residuals_3D3D, residuals_3D2D, residuals_2D3D, residuals_2D2D, residuals_3DPD;
-    int ri = 0;
     for(int cam = 0; cam < num_cams; cam++) {
-        auto &mc = good_matches[cam];
-        for(int i=0; i<mc.size(); i++) {
-            switch(residual_type[cam][i]) {
-                case RESIDUAL_3D3D:
-                    residuals_3D3D.push_back(
-                            sqrt(
-                                residuals[ri]*residuals[ri] +
-                                residuals[ri+1]*residuals[ri+1] +
-                                residuals[ri+2]*residuals[ri+2])
-                            );
-                    ri += 3;
-                    break;
-                case RESIDUAL_3D2D:
-                    residuals_3D2D.push_back(
-                            sqrt(
-                                residuals[ri]*residuals[ri] +
-                                residuals[ri+1]*residuals[ri+1]
-                                )
-                            );
-                    ri += 2;
-                    break;
-                case RESIDUAL_2D3D:
-                    residuals_2D3D.push_back(
-                            sqrt(
-                                residuals[ri]*residuals[ri] +
-                                residuals[ri+1]*residuals[ri+1]
-                                )
-                            );
-                    ri += 2;
-                    break;
-                case RESIDUAL_2D2D:
-                    residuals_2D2D.push_back(abs(residuals[ri]));
-                    ri++;
-                    break;
-                default:
-                    break;
-            }
-        }
+        residuals.batch_3D3D[cam]->squaredNorms(transform, residuals_3D3D);
+        residuals.batch_3D2D[cam]->squaredNorms(transform, residuals_3D2D);
+        residuals.batch_2D3D[cam]->squaredNorms(transform, residuals_2D3D);
+        residuals.batch_2D2D[cam]->squaredNorms(transform, residuals_2D2D);
     }
-    for(; ri < residuals.size(); ri++) {
-        residuals_3DPD.push_back(abs(residuals[ri]));
+    residuals.batch_3DPD.squaredNorms(transform, residuals_3DPD);
+    double cost = 0;
+    int blocks = 0;
+    for(auto r : {&residuals_3D3D, &residuals_3D2D, &residuals_2D3D, &residuals_2D2D, &residuals_3DPD}) {
+        for(auto &s : *r) {
+            cost += s/2;
+            s = sqrt(s);
+        }
+        blocks += r->size();
     }
+    int ri = residuals_3D3D.size() * 3 + residuals_3D2D.size() * 2
+        + residuals_2D3D.size() * 2 + residuals_2D2D.size() + residuals_3DPD.size();
     double sum_3D3D = 0, sum_3D2D = 0, sum_2D3D = 0, sum_2D2D = 0, sum_3DPD = 0;
     for(auto r : residuals_3D3D) {sum_3D3D += r;}
     for(auto r : residuals_3D2D) {sum_3D2D += r;}
@@ -986,8 +1757,8 @@ void residualStats(
     std::sort(residuals_2D2D.begin(), residuals_2D2D.end());
     std::sort(residuals_3DPD.begin(), residuals_3DPD.end());
     std::cerr << "Cost: " << cost
-        << " Residual blocks: " << problem.NumResidualBlocks()
-        << " Residuals: " << problem.NumResiduals() << " " << ri << " " << residuals.size()
+        << " Residual blocks: " << blocks
+        << " Residuals: " << ri
         << std::endl
         << " Total good matches: ";
     for(int cam=0; cam<num_cams; cam++) {
@@ -1024,121 +1795,275 @@ void residualStats(
             << " count " << residuals_3DPD.size() << std::endl;
 }
 
+struct TriangulationRow {
+    // an observation of a landmark p as M = A p + b in the observing
+    // frame, compared against (x, y, z) if depth else against (x, y)
+    // after projection
+    Eigen::Matrix3d A;
+    Eigen::Vector3d b;
+    double x, y, z;
+    bool depth;
+};
+
+double triangulationCost(
+        const std::vector<TriangulationRow> &rows,
+        const RobustLoss &loss_2D,
+        const Eigen::Vector3d &p,
+        Eigen::Matrix3d *H,
+        Eigen::Vector3d *g
+        ) {
+    // triangulation3D and Cauchy weighted triangulation2D, with the
+    // IRLS normal equations if H and g are given
+    double cost = 0;
+    if(H) {
+        H->setZero();
+        g->setZero();
+    }
+    for(const auto &row : rows) {
+        Eigen::Vector3d M = row.A * p + row.b;
+        if(row.depth) {
+            Eigen::Vector3d r = M - Eigen::Vector3d(row.x, row.y, row.z);
+            cost += r.squaredNorm() / 2;
+            if(H) {
+                H->noalias() += row.A.transpose() * row.A;
+                g->noalias() += row.A.transpose() * r;
+            }
+        } else {
+            Eigen::Vector2d r(M[0] - row.x * M[2], M[1] - row.y * M[2]);
+            double rho, drho;
+            loss_2D.evaluate(r.squaredNorm(), rho, drho);
+            cost += loss_2D.weight * rho / 2;
+            if(H) {
+                Eigen::Matrix<double, 2, 3> J;
+                J.row(0) = row.A.row(0) - row.x * row.A.row(2);
+                J.row(1) = row.A.row(1) - row.y * row.A.row(2);
+                double w = loss_2D.weight * drho;
+                H->noalias() += w * J.transpose() * J;
+                g->noalias() += w * J.transpose() * r;
+            }
+        }
+    }
+    return cost;
+}
+
+TriangulationRow triangulationRow(
+        const Observation &obs,
+        const double pose[6]
+        ) {
+    double R[9];
+    ceres::AngleAxisToRotationMatrix(pose, R);
+    TriangulationRow row;
+    // R(-w) (p - t) = R(w)^T p - R(w)^T t
+    row.A = Eigen::Map<const Eigen::Matrix3d>(R).transpose();
+    row.b = -row.A * Eigen::Vector3d(pose[3], pose[4], pose[5]);
+    if(!obs.depth) {
+        row.b += cam_trans[obs.cam].cast<double>();
+    }
+    row.x = obs.x;
+    row.y = obs.y;
+    row.z = obs.z;
+    row.depth = obs.depth;
+    return row;
+}
+
+void triangulationRows(
+        const TrackStore &tracks,
+        const int id,
+        const std::vector<double[6]> &camera_poses,
+        std::vector<TriangulationRow> &rows
+        ) {
+    rows.clear();
+    for(int cam=0; cam<num_cams; cam++) {
+        tracks.forEach(id, [&](const Observation &obs) {
+                if(obs.cam != cam) return;
+                rows.push_back(triangulationRow(obs, camera_poses[obs.frame]));
+                });
+    }
+}
+
+Eigen::Vector3d initialTriangulation(
+        const std::vector<TriangulationRow> &rows,
+        const pcl::PointXYZ &point,
+        const bool initial_guess
+        ) {
+    // without an initial guess, the first 3D observation solved
+    // for exactly, or 10m in front of the camera if there's none
+    if(initial_guess) {
+        return Eigen::Vector3d(point.x, point.y, point.z);
+    }
+    for(const auto &row : rows) {
+        if(row.depth) {
+            return row.A.transpose() * (Eigen::Vector3d(row.x, row.y, row.z) - row.b);
+        }
+    }
+    return Eigen::Vector3d(0, 0, 10);
+}
+
+void solveTriangulation(
+        const std::vector<TriangulationRow> &rows,
+        Eigen::Vector3d &p
+        ) {
+    // Gauss-Newton on the 3 coordinates, damped only when a step
+    // doesn't decrease the cost
+    RobustLoss loss_2D(RobustLoss::CAUCHY, loss_thresh_3D2D, weight_3D2D);
+    Eigen::Matrix3d H;
+    Eigen::Vector3d g;
+    double cost = triangulationCost(rows, loss_2D, p, &H, &g),
+           lambda = 0;
+    for(int iter = 0; iter < FLAGS_solver_max_iterations && std::isfinite(cost); iter++) {
+        Eigen::Matrix3d A = H;
+        A.diagonal() += lambda * H.diagonal().cwiseMax(1e-6);
+        Eigen::Vector3d delta = A.ldlt().solve(-g);
+        if(!delta.allFinite()) {
+            lambda = std::max(lambda * 10, 1e-4);
+            continue;
+        }
+        if(delta.norm() <= pose_parameter_tolerance * (p.norm() + pose_parameter_tolerance)) break;
+        double cost_new = triangulationCost(rows, loss_2D, p + delta, NULL, NULL);
+        if(!(cost_new < cost)) {
+            lambda = std::max(lambda * 10, 1e-4);
+            continue;
+        }
+        p += delta;
+        lambda /= 10;
+        double decrease = cost - cost_new;
+        cost = triangulationCost(rows, loss_2D, p, &H, &g);
+        if(decrease <= FLAGS_solver_function_tolerance * (cost + decrease)) break;
+    }
+}
+
 void triangulatePoint(
-        const std::vector<std::map<int, cv::Point2f>> &keypoint_obs2,
-        const std::vector<std::map<int, pcl::PointXYZ>> &keypoint_obs3,
+        const TrackStore &tracks,
+        const int id,
         const std::vector<double[6]> &camera_poses,
         pcl::PointXYZ &point,
         bool initial_guess
         ) {
-    // given the 2D and 3D observations, the goal is to obtain
-    // the 3D position of the point
-    int initialized = 0;
-    // 0: uninitialized
-    // 1: one 2d measurement
-    // 2: two 2d measurements
-    // 3: initialized
-    double transform[3] = {0, 0, 10};
-    if(initial_guess) {
-        transform[0] = point.x;
-        transform[1] = point.y;
-        transform[2] = point.z;
-        initialized = 3;
+    // given the 2D and 3D observations of keypoint id,
+    // the goal is to obtain the 3D position of the point
+    thread_local std::vector<TriangulationRow> rows_scratch;
+    std::vector<TriangulationRow> &rows = rows_scratch;
+    triangulationRows(tracks, id, camera_poses, rows);
+    Eigen::Vector3d p = initialTriangulation(rows, point, initial_guess);
+    solveTriangulation(rows, p);
+    point.x = p[0];
+    point.y = p[1];
+    point.z = p[2];
+}
+
+struct LandmarkState {
+    // Information form of a landmark: every residual is linear in the
+    // point, so with the IRLS weights frozen at p_lin the normal
+    // equations H p = h can take new observations without revisiting
+    // old ones. folded observations of the track are in H and h
+    Eigen::Matrix3d H;
+    Eigen::Vector3d h, p_lin;
+    int folded = 0;
+};
+
+void foldObservation(
+        const TriangulationRow &row,
+        const RobustLoss &loss_2D,
+        const Eigen::Vector3d &p,
+        LandmarkState &state
+        ) {
+    // residual J p - y, weighted at p
+    if(row.depth) {
+        state.H.noalias() += row.A.transpose() * row.A;
+        state.h.noalias() += row.A.transpose()
+            * (Eigen::Vector3d(row.x, row.y, row.z) - row.b);
+        return;
     }
+    Eigen::Matrix<double, 2, 3> J;
+    J.row(0) = row.A.row(0) - row.x * row.A.row(2);
+    J.row(1) = row.A.row(1) - row.y * row.A.row(2);
+    Eigen::Vector2d y(row.x * row.b[2] - row.b[0], row.y * row.b[2] - row.b[1]);
+    double rho, drho;
+    loss_2D.evaluate((J * p - y).squaredNorm(), rho, drho);
+    double w = loss_2D.weight * drho;
+    state.H.noalias() += w * J.transpose() * J;
+    state.h.noalias() += w * J.transpose() * y;
+}
 
-    ceres::Problem problem;
-    ceres::Solver::Options options;
-    options.linear_solver_type = ceres::DENSE_SCHUR;
-    options.minimizer_progress_to_stdout = false;
-    ceres::Solver::Summary summary;
-    for(int cam=0; cam<num_cams; cam++) {
-        for(auto obs3 : keypoint_obs3[cam]) {
-            /*
-            std::cerr << "3D observation " <<  obs3.second
-                << " at " << obs3.first << ": ";
-            for(int i=0; i<6; i++) {
-                std::cerr << camera_poses[obs3.first][i] << " ";
-            }
-            std::cerr << std::endl;
-            std::cerr << util::pose_mat2vec(camera_poses[obs3.first]);
-            std::cerr << std::endl;
-            */
-            ceres::CostFunction* cost_function =
-                new ceres::AutoDiffCostFunction<triangulation3D, 3, 3>(
-                        new triangulation3D(
-                            obs3.second.x,
-                            obs3.second.y,
-                            obs3.second.z,
-                            camera_poses[obs3.first][0],
-                            camera_poses[obs3.first][1],
-                            camera_poses[obs3.first][2],
-                            camera_poses[obs3.first][3],
-                            camera_poses[obs3.first][4],
-                            camera_poses[obs3.first][5]
-                            )
-                        );
-            problem.AddResidualBlock(
-                    cost_function,
-                    new ceres::TrivialLoss,
-                    //new ceres::CauchyLoss(loss_thresh_3D3D),
-                    transform);
-            if(!initialized) {
-                initialized = 3;
-                ceres::Solve(options, &problem, &summary);
-            }
+void updateLandmark(
+        const TrackStore &tracks,
+        const int id,
+        const std::vector<double[6]> &camera_poses,
+        pcl::PointXYZ &point,
+        bool initial_guess,
+        LandmarkState &state
+        ) {
+    // folds the observations made since the last update into the
+    // landmark's normal equations. it's fully triangulated again
+    // if it's new or the estimate moved more than
+    // landmark_relinearize_thresh from p_lin
+    RobustLoss loss_2D(RobustLoss::CAUCHY, loss_thresh_3D2D, weight_3D2D);
+    int size = tracks.size(id);
+    if(initial_guess && state.folded > 0) {
+        // weighted at p_lin like the rows already folded in
+        tracks.forEachSince(id, state.folded, [&](const Observation &obs) {
+                foldObservation(triangulationRow(obs, camera_poses[obs.frame]),
+                        loss_2D, state.p_lin, state);
+                });
+        state.folded = size;
+        Eigen::Vector3d p = state.H.ldlt().solve(state.h);
+        if(p.allFinite() && (p - state.p_lin).norm() <= landmark_relinearize_thresh) {
+            point.x = p[0];
+            point.y = p[1];
+            point.z = p[2];
+            return;
         }
     }
-    for(int cam=0; cam<num_cams; cam++) {
-        for(auto obs2 : keypoint_obs2[cam]) {
-            /*
-            std::cerr << "2D observation " <<  obs2.second << ": ";
-            for(int i=0; i<6; i++) {
-                std::cerr << camera_poses[obs2.first][i] << " ";
-            }
-            std::cerr << ", " << cam_trans[cam].transpose();
-            std::cerr << std::endl;
-            */
-            ceres::CostFunction* cost_function =
-                new ceres::AutoDiffCostFunction<triangulation2D, 2, 3>(
-                        new triangulation2D(
-                            obs2.second.x,
-                            obs2.second.y,
-                            camera_poses[obs2.first][0],
-                            camera_poses[obs2.first][1],
-                            camera_poses[obs2.first][2],
-                            camera_poses[obs2.first][3],
-                            camera_poses[obs2.first][4],
-                            camera_poses[obs2.first][5],
-                            cam_trans[cam](0),
-                            cam_trans[cam](1),
-                            cam_trans[cam](2)
-                            )
-                        );
-            problem.AddResidualBlock(
-                    cost_function,
-                    new ceres::ScaledLoss(
-                        new ceres::CauchyLoss(loss_thresh_3D2D),
-                        weight_3D2D,
-                        ceres::TAKE_OWNERSHIP),
-                    transform);
-        }
+    thread_local std::vector<TriangulationRow> rows_scratch;
+    std::vector<TriangulationRow> &rows = rows_scratch;
+    triangulationRows(tracks, id, camera_poses, rows);
+    Eigen::Vector3d p = initialTriangulation(rows, point, initial_guess);
+    solveTriangulation(rows, p);
+    state.H.setZero();
+    state.h.setZero();
+    for(const auto &row : rows) {
+        foldObservation(row, loss_2D, p, state);
     }
-    ceres::Solve(options, &problem, &summary);
-    point.x = transform[0];
-    point.y = transform[1];
-    point.z = transform[2];
+    state.p_lin = p;
+    state.folded = size;
+    point.x = p[0];
+    point.y = p[1];
+    point.z = p[2];
+}
+
+void triangulatePoints(
+        const TrackStore &tracks,
+        const std::vector<int> &ids,
+        const std::vector<double[6]> &camera_poses,
+        pcl::PointCloud<pcl::PointXYZ> &landmarks,
+        const std::vector<bool> &initialized,
+        const std::vector<LandmarkState*> &states
+        ) {
+    // every point is independent, so they're split among threads
+    thread_pool.parallelFor(0, ids.size(), triangulation_grain, [&](int b, int e) {
+            for(int i=b; i<e; i++) {
+                int id = ids[i];
+                updateLandmark(
+                        tracks,
+                        id,
+                        camera_poses,
+                        landmarks.at(id),
+                        initialized[id],
+                        *states[i]);
+            }
+            });
 }
 
 void getLandmarksAtFrame(
         const Eigen::Matrix4d &pose,
         const pcl::PointCloud<pcl::PointXYZ>::Ptr landmarks,
         const std::vector<bool> &keypoint_added,
-        const std::vector<std::vector<std::vector<int>>> &keypoint_ids,
+        const FrameStore &features,
         const int frame,
         std::map<int, pcl::PointXYZ> &landmarks_at_frame) {
     Eigen::Matrix4d poseinv = pose.inverse();
     for(int cam = 0; cam < num_cams; cam++) {
-        for(int id : keypoint_ids[cam][frame]) {
+        for(int id : features.at(cam, frame).ids) {
             if(landmarks_at_frame.count(id)) continue;
             if(!keypoint_added[id]) continue;
             auto point = landmarks->at(id);